@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * corsair-hxi-linear11.h - linear11 decoding of corsair-hxi-psu
+ *
+ * Kept apart from the driver so tools/linear11-test can build the very same
+ * code in userspace and check it, see there for the types it has to provide.
+ */
+
+#ifndef _CORSAIR_HXI_LINEAR11_H
+#define _CORSAIR_HXI_LINEAR11_H
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/types.h>
+#endif
+
+/*
+ * The PSU reports voltage/current/power measurements in this 16-bit
+ * floating-point format as described in the
+ * PMBUS spec, v1.2, Part II, section 8.3.1
+ *
+ * There is already code for this in the PMBus section of hwmon, but I didn't
+ * want this module to depend on any of the PMBus components because PMBus is
+ * so heavily tied in with I2C, and this is a USBHID driver.
+ *
+ * The exact behavior, which any rewrite has to keep bit for bit:
+ *  - bits 15..11 are a two's complement exponent (-16..15), bits 10..0 a two's
+ *    complement mantissa (-1024..1023)
+ *  - an odd mantissa is bumped by one towards +inf before scaling, so 3
+ *    decodes like 4 and -3 like -2
+ *  - the mantissa is scaled by 1000 first, then shifted; negative exponents
+ *    shift arithmetically, i.e. round towards -inf
+ *  - exponents above 11 can overflow an int; the PSU doesn't report those
+ *
+ * It was reimplemented with a scale table to get rid of the branches and the
+ * variable shift direction. tools/linear11-test (make check) compares it with
+ * the old version for all 65536 inputs.
+ */
+static int decode_corsair_float(u16 input)
+{
+	/*
+	 * Scale by exponent, indexed by its raw 5 bits: multiply by 1000 << e
+	 * for e >= 0, multiply by 1000 and shift right by -e for e < 0.
+	 */
+#define L11_POS(e) { 1000 << (e), 0 }
+#define L11_NEG(e) { 1000, (e) }
+	static const struct {
+		s32 mul;
+		u8 shift;
+	} scale[32] = {
+		L11_POS(0), L11_POS(1), L11_POS(2), L11_POS(3),
+		L11_POS(4), L11_POS(5), L11_POS(6), L11_POS(7),
+		L11_POS(8), L11_POS(9), L11_POS(10), L11_POS(11),
+		L11_POS(12), L11_POS(13), L11_POS(14), L11_POS(15),
+		L11_NEG(16), L11_NEG(15), L11_NEG(14), L11_NEG(13),
+		L11_NEG(12), L11_NEG(11), L11_NEG(10), L11_NEG(9),
+		L11_NEG(8), L11_NEG(7), L11_NEG(6), L11_NEG(5),
+		L11_NEG(4), L11_NEG(3), L11_NEG(2), L11_NEG(1),
+	};
+#undef L11_POS
+#undef L11_NEG
+	s32 fraction = sign_extend32(input, 10);
+
+	fraction += fraction & 1;
+	/* truncating to s32 wraps like the shifts on int used to */
+	return (s32)(((s64)fraction * scale[input >> 11].mul) >> scale[input >> 11].shift);
+}
+
+#endif /* _CORSAIR_HXI_LINEAR11_H */
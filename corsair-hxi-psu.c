@@ -11,6 +11,11 @@
  * This driver uses hid reports to communicate with the device to allow hidraw
  * userspace drivers still being used. The device does not use report ids.
  * When using hidraw and this driver simultaneously, reports could be switched.
+ * Replies that do not echo the command and register of the request in flight
+ * are dropped and counted in debugfs. Every request carries its own reply
+ * buffer, so a late reply can never overwrite a command that is being sent.
+ * Requests are queued in batches and the next one is sent as soon as the
+ * reply to the previous one arrives.
  *
  * Broadly speaking, this power supply communicates with a sort of
  * PMBUS-over-USBHID protocol.
@@ -20,24 +25,57 @@
  *      * voltage, current, and power for 12V, 5V, 3.3V rails
  *      * input (wall) voltage
  *      * total input (wall) power
- * Supposedly, the PSU supports the following functionality that is not yet
- * supported by this driver:
- *      * changing the fan control mode from automatic to manual
- *      * setting fan speed
- *      * reading/writing different overcurrent-protection modes
+ *      * fan speed
+ *      * over-current protection limits of the 12V/5V/3.3V rails
+ * and for changing the fan control mode from automatic to manual, setting
+ * the fan duty cycle and switching between single and multi rail
+ * over-current protection.
  */
 
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/bits.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/idr.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/kfifo_buf.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/perf_event.h>
+#include <linux/poll.h>
+#include <linux/powercap.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "corsair-hxi-linear11.h"
+#include "corsair-hxi-psu.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jack Doan <me@jackdoan.com>");
 
+#define DRIVER_NAME "corsair-hxi"
+
 #define USB_VENDOR_ID_CORSAIR            0x1b1c
 #define USB_PRODUCT_ID_CORSAIR_HX750i    0x1c05
 #define USB_PRODUCT_ID_CORSAIR_HX850i    0x1c06
@@ -45,16 +83,47 @@ MODULE_AUTHOR("Jack Doan <me@jackdoan.com>");
 #define USB_PRODUCT_ID_CORSAIR_HX1200i    0x1c08
 
 #define OUT_BUFFER_SIZE 63
-#define IN_BUFFER_SIZE 16
+#define IN_BUFFER_SIZE 24 /* longest reply is a string after command and register */
+#define REPLY_STR_LENGTH (IN_BUFFER_SIZE - 2 + 1)
+#define CMD_LENGTH 3
+#define MAX_BATCH 4 /* channel switch and volts, amps and watts of a rail */
 #define LABEL_LENGTH 8
-#define REQ_TIMEOUT 300
+#define REQ_TIMEOUT 300 /* ms, also the initial timeout */
+#define REQ_TIMEOUT_MIN 20 /* ms */
+#define MAX_RETRIES 10
+#define MAX_RETRY_BACKOFF 100 /* ms */
 #define NUM_RAILS 4
+#define NUM_TEMPS 2
+#define MIN_SAMPLE_INTERVAL 100 /* ms */
+#define MAX_SAMPLE_INTERVAL 60000 /* ms */
+#define RING_RECORDS 1024 /* power of two */
+#define READ_BATCH 64 /* records copied out of the ring per ring->lock */
+#define ENERGY_MAX_GAP 4 /* update_intervals bridged between power readings */
+#define CURVE_POINTS 5
+#define CURVE_MAX_TEMP 125000 /* millidegrees */
+
+static unsigned int sample_interval = 1000;
+module_param(sample_interval, uint, 0444);
+MODULE_PARM_DESC(sample_interval, "Default update_interval in ms (100-60000)");
+
+static unsigned int retries = 2;
+module_param(retries, uint, 0644);
+MODULE_PARM_DESC(retries, "How often a failed request is sent again (0-10)");
+
+static unsigned int retry_backoff = 5;
+module_param(retry_backoff, uint, 0644);
+MODULE_PARM_DESC(retry_backoff, "Delay before the first retry in ms, doubled for each further one (max 100)");
+
+static unsigned int max_stale;
+module_param(max_stale, uint, 0644);
+MODULE_PARM_DESC(max_stale, "Report the last good value for up to this many ms when reading fails (0: report errors)");
 
 enum hxi_sensor_id {
 	SENSOR_12V = 0x0,
 	SENSOR_5V = 0x1,
 	SENSOR_3V = 0x2,
-	UNSWITCHED = 0xFE // do not send a sensor switch msg
+	UNSWITCHED = 0xFE, // do not send a sensor switch msg
+	SENSOR_UNKNOWN = 0xFF // selected page is unknown, always switch
 };
 
 enum hxi_sensor_cmd {
@@ -65,9 +134,60 @@ enum hxi_sensor_cmd {
 	SIG_TEMPERATURE_2 = 0x8E,
 	SIG_WATTS = 0x96,
 	SIG_TOTAL_WATTS = 0xEE,
+	SIG_FAN = 0x90,
+	SIG_FAN_DUTY = 0x3B, /* percent, a single byte */
+	SIG_FAN_MODE = 0xF0, /* a single byte, see enum hxi_fan_mode */
+	SIG_OCP_LIMIT = 0x46,
+	SIG_OCP_MODE = 0xD8, /* a single byte, see enum hxi_ocp_mode */
+	SIG_VENDOR = 0x99, /* string */
+	SIG_PRODUCT = 0x9A, /* string */
+	SIG_REVISION = 0x9B, /* string */
+	SIG_TOTAL_UPTIME = 0xD1, /* seconds, 32 bit */
+	SIG_UPTIME = 0xD2, /* seconds since power on, 32 bit */
 	SIG_POORLY_UNDERSTOOD_INIT = 0xfe,
 };
 
+enum hxi_fan_mode {
+	FAN_MODE_HARDWARE = 0x0,
+	FAN_MODE_SOFTWARE = 0x1, /* SIG_FAN_DUTY is applied */
+};
+
+/* over-current protection of the 12V rail */
+enum hxi_ocp_mode {
+	OCP_MODE_SINGLE = 0x1,
+	OCP_MODE_MULTI = 0x2,
+};
+
+/* pwm1_enable values */
+enum hxi_pwm_enable {
+	PWM_ENABLE_MANUAL = 1,
+	PWM_ENABLE_HARDWARE = 2, /* the PSU's own fan control */
+	PWM_ENABLE_CURVE = 3, /* hxi_fan_curve_apply() */
+};
+
+/*
+ * Piecewise linear fan curve, pwm1_auto_point*. Below the first and above the
+ * last point the duty stays at that point's pwm.
+ */
+struct hxi_fan_curve {
+	int temp[CURVE_POINTS]; /* millidegrees */
+	u8 pwm[CURVE_POINTS]; /* 0-255 */
+	unsigned int channels; /* pwm1_auto_channels_temp, hottest one counts */
+};
+
+/*
+ * Identification and uptime counters, read once at probe. Strings are empty
+ * and counters -1 if the PSU did not answer.
+ */
+struct hxi_ident {
+	char vendor[REPLY_STR_LENGTH];
+	char product[REPLY_STR_LENGTH];
+	char revision[REPLY_STR_LENGTH];
+	s64 total_uptime; /* seconds */
+	s64 uptime; /* seconds */
+	unsigned long stamp; /* jiffies the counters were read at */
+};
+
 struct hxi_rail {
 	enum hxi_sensor_id sensor;
 	enum hxi_sensor_cmd volt_cmd;
@@ -76,317 +196,2231 @@ struct hxi_rail {
 	char label[LABEL_LENGTH];
 };
 
+/*
+ * A single command and its reply. The reply is only written by
+ * hxi_raw_event() while the request is hxi->cur.
+ */
+struct hxi_request {
+	struct list_head node;
+	u8 cmd[CMD_LENGTH]; /* command, register, value */
+	u8 reply[IN_BUFFER_SIZE];
+	int status;
+	unsigned int attempts; /* retries so far */
+	bool last; /* end of a batch, done is completed when it is over */
+	struct completion done;
+};
+
+/* a hwmon channel, e.g. { hwmon_curr, 1 } for curr2_input */
+struct hxi_channel {
+	enum hwmon_sensor_types type;
+	int chan;
+};
+
+/*
+ * The last good value read from a sensor, in the units hwmon expects, and the
+ * outcome of the last attempt to read it.
+ */
+struct hxi_reading {
+	int value;
+	int err; /* error of the last attempt, 0 if it returned value */
+	bool valid; /* value has been read at least once */
+	unsigned long stamp; /* jiffies of the last attempt */
+	unsigned long good_stamp; /* jiffies value was read at */
+	bool pending; /* a reader is refreshing it, wait on refresh_wait */
+};
+
+struct hxi_sample {
+	struct hxi_reading temp[NUM_TEMPS];
+	struct hxi_reading volts[NUM_RAILS];
+	struct hxi_reading amps[NUM_RAILS];
+	struct hxi_reading watts[NUM_RAILS];
+	struct hxi_reading fan; /* milli-RPM */
+};
+
+/*
+ * Energy used on a rail, integrated by the sampler. uj is atomic as the perf
+ * PMU reads it from IPIs, which must not spin on sample_seq.
+ */
+struct hxi_energy {
+	atomic64_t uj; /* microjoules */
+	u32 rem; /* leftover of the last integration, in mW * ns / 2 */
+	int last_mw; /* power at stamp_ns */
+	u64 stamp_ns; /* of the last power reading integrated, 0 if none yet */
+};
+
+/*
+ * The energy counters and the perf PMU counting them. They are reference
+ * counted because perf events keep reading them after the PSU is gone.
+ */
+struct hxi_counters {
+	struct kref kref;
+	struct hxi_energy energy[NUM_RAILS]; /* only written by the sampler */
+#ifdef CONFIG_PERF_EVENTS
+	struct pmu pmu;
+	unsigned int cpu; /* the energy events are counted on */
+	struct hlist_node node; /* instance of hxi_cpuhp_state */
+	bool registered;
+#endif
+};
+
+/*
+ * History of sweeps behind /dev/hxipsu<N>. It is reference counted because
+ * open files keep using it after the PSU is gone.
+ */
+struct hxi_ring {
+	struct miscdevice misc;
+	char name[16];
+	int id;
+	struct kref kref;
+	struct mutex lock; /* protects records and head */
+	struct hxi_ring_header *header; /* start of the mmap()able area */
+	struct hxi_record *records; /* right behind header's page */
+	u64 head; /* records written so far, published in header */
+	wait_queue_head_t wait;
+	bool dead; /* the PSU has been removed */
+};
+
+/* an open file of the ring, pos is the next record it reads */
+struct hxi_reader {
+	struct hxi_ring *ring;
+	u64 pos;
+};
+
+/* a powercap zone and the rail it reports, see hxi_powercap_register() */
+struct hxi_zone {
+	struct hxi_device *hxi;
+	int chan;
+	struct powercap_zone *zone;
+};
+
 struct hxi_device {
 	struct hid_device *hdev;
 	struct device *hwmon_dev;
-	struct completion wait_input_report;
-	struct mutex mutex; /* whenever buffer is used, lock before send_usb_cmd */
-	u8 *buffer;
+	struct mutex mutex; /* serializes send_usb_cmds, held while writing sample */
+	u8 *tx_buffer; /* only used by tx_work */
+	spinlock_t lock; /* protects queue, cur, tx_seq and deadline */
+	struct list_head queue;
+	struct hxi_request *cur; /* request waiting for its reply */
+	unsigned int tx_seq; /* bumped for every request sent */
+	ktime_t sent; /* for cur */
+	unsigned long deadline; /* jiffies, for cur */
+	u32 srtt_us; /* smoothed round trip time, 0 until the first reply */
+	u32 rttvar_us;
+	u32 timeout_us;
+	struct delayed_work tx_work;
+	struct timer_list timeout;
+	enum hxi_sensor_id page; /* rail selected on the PSU, written under mutex or lock */
 	struct hxi_rail rails[NUM_RAILS];
+	seqlock_t sample_seq; /* protects sample, writers also hold mutex */
+	struct hxi_sample sample;
+	struct hxi_counters *counters;
+	wait_queue_head_t refresh_wait;
+	struct delayed_work sample_work;
+	unsigned int update_interval; /* ms */
+	struct mutex fan_lock; /* protects curve, fan_curve and curve_duty */
+	struct hxi_fan_curve curve;
+	bool fan_curve; /* the driver runs the fan along curve */
+	int curve_duty; /* percent last set for curve, -1 if unknown */
+	int ocp_limit[NUM_RAILS - 1]; /* mA or -errno, see hxi_read_ocp_limits() */
+	struct hxi_ring *ring;
+	struct hxi_ident ident;
+#if IS_REACHABLE(CONFIG_POWERCAP)
+	struct powercap_control_type *powercap;
+	struct hxi_zone zones[NUM_RAILS];
+#endif
+#if IS_REACHABLE(CONFIG_IIO_KFIFO_BUF)
+	struct iio_dev *iio; /* NULL if it couldn't be registered */
+#endif
+	struct dentry *debugfs;
+	u32 transactions;
+	u32 reply_mismatches;
+	u32 retried;
 };
 
-/* send command, check for error in response, response in hxi->buffer */
-static int send_usb_cmd(struct hxi_device *hxi, u8 command, u8 b1, u8 b2)
+static void hxi_cmd(struct hxi_request *req, u8 command, u8 b1, u8 b2)
+{
+	req->cmd[0] = command;
+	req->cmd[1] = b1;
+	req->cmd[2] = b2;
+}
+
+/*
+ * Updates the smoothed round trip time and derives the request timeout from
+ * it, the same way TCP computes its retransmission timeout (RFC 6298).
+ * Must be called with hxi->lock held.
+ */
+static void hxi_rtt_sample(struct hxi_device *hxi, u32 rtt_us)
+{
+	rtt_us = max(rtt_us, 1U);
+
+	if (!hxi->srtt_us) {
+		hxi->srtt_us = rtt_us;
+		hxi->rttvar_us = rtt_us / 2;
+	} else {
+		hxi->rttvar_us = (3 * hxi->rttvar_us + abs((s32)(hxi->srtt_us - rtt_us))) / 4;
+		hxi->srtt_us = (7 * hxi->srtt_us + rtt_us) / 8;
+	}
+
+	hxi->timeout_us = clamp_t(u32, hxi->srtt_us + 4 * hxi->rttvar_us,
+				  REQ_TIMEOUT_MIN * USEC_PER_MSEC, REQ_TIMEOUT * USEC_PER_MSEC);
+}
+
+/*
+ * Ends the request in flight and kicks off the next one. A failed request is
+ * put back at the head of the queue and sent again after a short, doubling
+ * delay, up to retries times. When it still fails, the rest of its batch fails
+ * with it as it usually depends on it, e.g. reads behind a channel switch.
+ * Must be called with hxi->lock held.
+ */
+static void hxi_finish(struct hxi_device *hxi, int status)
+{
+	struct hxi_request *req = hxi->cur;
+	unsigned int backoff;
+
+	hxi->cur = NULL;
+	timer_delete(&hxi->timeout);
+
+	if (status && req->attempts < min(retries, MAX_RETRIES)) {
+		backoff = min(retry_backoff << min(req->attempts, 8U), MAX_RETRY_BACKOFF);
+		req->attempts++;
+		hxi->retried++;
+		list_add(&req->node, &hxi->queue);
+		mod_delayed_work(system_highpri_wq, &hxi->tx_work, msecs_to_jiffies(backoff));
+		return;
+	}
+
+	req->status = status;
+	while (status && !req->last) {
+		req = list_first_entry(&hxi->queue, struct hxi_request, node);
+		list_del(&req->node);
+		req->status = -ECANCELED;
+	}
+	if (req->last)
+		complete(&req->done);
+
+	if (!list_empty(&hxi->queue))
+		queue_delayed_work(system_highpri_wq, &hxi->tx_work, 0);
+}
+
+/*
+ * Sends the next queued request. Sending an output report may sleep, so this
+ * cannot happen in hxi_raw_event() itself. Instead whoever ends a request
+ * queues this work: the reply, the timeout or a submission to an idle device.
+ */
+static void hxi_tx_work(struct work_struct *work)
+{
+	struct hxi_device *hxi = container_of(to_delayed_work(work), struct hxi_device, tx_work);
+	struct hxi_request *req;
+	unsigned int seq;
+	int ret;
+
+	spin_lock_irq(&hxi->lock);
+	if (hxi->cur || list_empty(&hxi->queue)) {
+		spin_unlock_irq(&hxi->lock);
+		return;
+	}
+	req = list_first_entry(&hxi->queue, struct hxi_request, node);
+	list_del(&req->node);
+	hxi->cur = req;
+	hxi->transactions++;
+	seq = ++hxi->tx_seq;
+	memset(hxi->tx_buffer, 0x00, OUT_BUFFER_SIZE);
+	memcpy(hxi->tx_buffer, req->cmd, CMD_LENGTH);
+	hxi->sent = ktime_get();
+	hxi->deadline = jiffies + usecs_to_jiffies(hxi->timeout_us);
+	mod_timer(&hxi->timeout, hxi->deadline);
+	spin_unlock_irq(&hxi->lock);
+
+	ret = hid_hw_output_report(hxi->hdev, hxi->tx_buffer, OUT_BUFFER_SIZE);
+	if (ret >= 0)
+		return;
+
+	/* req may already be gone if it timed out meanwhile, only trust seq */
+	spin_lock_irq(&hxi->lock);
+	if (hxi->cur && hxi->tx_seq == seq)
+		hxi_finish(hxi, ret);
+	spin_unlock_irq(&hxi->lock);
+}
+
+static void hxi_timeout(struct timer_list *t)
+{
+	struct hxi_device *hxi = timer_container_of(hxi, t, timeout);
+	unsigned long flags;
+
+	spin_lock_irqsave(&hxi->lock, flags);
+	if (hxi->cur && time_after_eq(jiffies, hxi->deadline)) {
+		/* back off like TCP does, the device may just have become slower */
+		hxi->timeout_us = min_t(u32, 2 * hxi->timeout_us, REQ_TIMEOUT * USEC_PER_MSEC);
+		hxi_finish(hxi, -ETIMEDOUT);
+	}
+	spin_unlock_irqrestore(&hxi->lock, flags);
+}
+
+/*
+ * Queues a batch of requests and waits until all of them are done. The
+ * requests are sent back to back without waking the caller in between.
+ * Returns the status of the first failed request, replies in reqs[i].reply.
+ * Must be called with hxi->mutex held.
+ */
+static int send_usb_cmds(struct hxi_device *hxi, struct hxi_request *reqs, int n)
+{
+	int i;
+
+	init_completion(&reqs[n - 1].done);
+
+	spin_lock_irq(&hxi->lock);
+	for (i = 0; i < n; i++) {
+		reqs[i].status = -EINPROGRESS;
+		reqs[i].attempts = 0;
+		reqs[i].last = i == n - 1;
+		list_add_tail(&reqs[i].node, &hxi->queue);
+	}
+	spin_unlock_irq(&hxi->lock);
+	queue_delayed_work(system_highpri_wq, &hxi->tx_work, 0);
+
+	wait_for_completion(&reqs[n - 1].done);
+
+	for (i = 0; i < n; i++) {
+		if (reqs[i].status)
+			return reqs[i].status;
+	}
+	return 0;
+}
+
+static int hxi_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
+{
+	struct hxi_device *hxi = hid_get_drvdata(hdev);
+	struct hxi_request *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hxi->lock, flags);
+
+	/* only copy buffer when requested */
+	req = hxi->cur;
+	if (!req)
+		goto exit;
+
+	/*
+	 * The reply starts with an echo of command and register. Anything else is
+	 * a late reply to a timed out request or belongs to a hidraw user.
+	 */
+	if (size < 2 || data[0] != req->cmd[0] || data[1] != req->cmd[1]) {
+		hxi->reply_mismatches++;
+		/* a hidraw user may have switched the rail too */
+		WRITE_ONCE(hxi->page, SENSOR_UNKNOWN);
+		goto exit;
+	}
+
+	memcpy(req->reply, data, min(IN_BUFFER_SIZE, size));
+	/* the reply to a retry might be for the first attempt, don't sample it */
+	if (!req->attempts)
+		hxi_rtt_sample(hxi, ktime_us_delta(ktime_get(), hxi->sent));
+	hxi_finish(hxi, 0);
+
+exit:
+	spin_unlock_irqrestore(&hxi->lock, flags);
+	return 0;
+}
+
+/*
+ * Gets one of the two temperature sensors in the PSU from its reply
+ * This code is different enough from the other sensors to justify pulling it out into it's own
+ * function to improve readability.
+ */
+static int get_temperature(struct hxi_request *req)
+{
+	if (req->status)
+		return -ENODATA;
+
+	return (req->reply[2] << 8) + req->reply[3];
+}
+
+/* Gets a voltage/current/power measurement from its reply */
+static int get_data(struct hxi_request *req)
+{
+	if (req->status)
+		return -ENODATA;
+
+	/*
+	 * Note that this is different byte order from temperature.
+	 * Thanks, PMBus.
+	 */
+	return decode_corsair_float((req->reply[3] << 8) + req->reply[2]);
+}
+
+static struct hxi_reading *hxi_reading(struct hxi_device *hxi,
+					enum hwmon_sensor_types type, int chan)
+{
+	switch (type) {
+	case hwmon_temp:
+		return &hxi->sample.temp[chan];
+	case hwmon_in:
+		return &hxi->sample.volts[chan];
+	case hwmon_curr:
+		return &hxi->sample.amps[chan];
+	case hwmon_power:
+		return &hxi->sample.watts[chan];
+	case hwmon_fan:
+		return &hxi->sample.fan;
+	default:
+		return NULL;
+	}
+}
+
+static enum hxi_sensor_id hxi_page(struct hxi_device *hxi, const struct hxi_channel *ch)
+{
+	if (ch->type == hwmon_temp || ch->type == hwmon_fan)
+		return UNSWITCHED;
+
+	return hxi->rails[ch->chan].sensor;
+}
+
+/* returns the register to read for a channel, 0 if it has none */
+static u8 hxi_register(struct hxi_device *hxi, const struct hxi_channel *ch)
+{
+	switch (ch->type) {
+	case hwmon_temp:
+		return ch->chan ? SIG_TEMPERATURE_2 : SIG_TEMPERATURE_1;
+	case hwmon_in:
+		return hxi->rails[ch->chan].volt_cmd;
+	case hwmon_curr:
+		return hxi->rails[ch->chan].amp_cmd;
+	case hwmon_power:
+		return hxi->rails[ch->chan].power_cmd;
+	case hwmon_fan:
+		return SIG_FAN;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Reads channels that are on the same bus into hxi->sample, as one batch.
+ * To maintain PMBUS-like behavior, the PSU switches "channels" when taking
+ * measurements from the 12V/5V/3.3V busses. Other sensors that have standard
+ * PMBUS commands are "unswitched"
+ * The selected channel is remembered, so only the first of several reads from
+ * the same bus sends a switch msg. It is assumed selected as soon as the switch
+ * is queued, so a reply mismatch during the batch, which means somebody else
+ * is talking to the PSU, forgets it again.
+ *
+ * Must be called with hxi->mutex held.
+ */
+static void hxi_update(struct hxi_device *hxi, const struct hxi_channel *chans, int n)
+{
+	enum hxi_sensor_id page = hxi_page(hxi, &chans[0]);
+	struct hxi_request reqs[MAX_BATCH];
+	struct hxi_reading *reading;
+	struct hxi_request *req;
+	bool switched = false;
+	int i, nr = 0;
+	int value;
+	u8 reg;
+
+	if (page != UNSWITCHED && page != READ_ONCE(hxi->page)) {
+		hxi_cmd(&reqs[nr++], 0x2, 0x0, page);
+		WRITE_ONCE(hxi->page, page);
+		switched = true;
+	}
+	for (i = 0; i < n; i++) {
+		reg = hxi_register(hxi, &chans[i]);
+		if (reg)
+			hxi_cmd(&reqs[nr++], 0x3, reg, 0);
+	}
+
+	if (nr)
+		send_usb_cmds(hxi, reqs, nr);
+	if (switched && reqs[0].status)
+		WRITE_ONCE(hxi->page, SENSOR_UNKNOWN);
+
+	req = &reqs[switched];
+	write_seqlock(&hxi->sample_seq);
+	for (i = 0; i < n; i++) {
+		reading = hxi_reading(hxi, chans[i].type, chans[i].chan);
+		if (!hxi_register(hxi, &chans[i]))
+			value = -ENODATA;
+		else if (chans[i].type == hwmon_temp)
+			value = get_temperature(req++);
+		else
+			value = get_data(req++);
+
+		reading->stamp = jiffies;
+		if (value < 0) {
+			reading->err = value;
+			continue;
+		}
+		reading->err = 0;
+		reading->value = value;
+		reading->valid = true;
+		reading->good_stamp = reading->stamp;
+	}
+	write_sequnlock(&hxi->sample_seq);
+}
+
+/* reads volts, amps and watts of one rail behind a single channel switch */
+static void hxi_sweep_rail(struct hxi_device *hxi, int i)
+{
+	const struct hxi_channel chans[] = {
+		{ hwmon_in, i },
+		{ hwmon_curr, i },
+		{ hwmon_power, i },
+	};
+
+	mutex_lock(&hxi->mutex);
+	hxi_update(hxi, chans, ARRAY_SIZE(chans));
+	mutex_unlock(&hxi->mutex);
+}
+
+/*
+ * Reads every sensor once. The mutex is only held per rail, so readers are
+ * never stuck behind a whole sweep.
+ *
+ * A hidraw user may have selected another rail since the last sweep without
+ * us seeing it, so every sweep starts by switching again.
+ */
+static void hxi_sweep(struct hxi_device *hxi)
+{
+	const struct hxi_channel unswitched[] = {
+		{ hwmon_temp, 0 },
+		{ hwmon_temp, 1 },
+		{ hwmon_fan, 0 },
+	};
+	int i;
+
+	mutex_lock(&hxi->mutex);
+	WRITE_ONCE(hxi->page, SENSOR_UNKNOWN);
+	hxi_update(hxi, unswitched, ARRAY_SIZE(unswitched));
+	mutex_unlock(&hxi->mutex);
+
+	for (i = 0; i < NUM_RAILS; i++)
+		hxi_sweep_rail(hxi, i);
+}
+
+/*
+ * Integrates the power of every rail since the last sweep with the trapezoidal
+ * rule. A rail whose power could not be read is skipped, the next good reading
+ * then covers the gap. A gap longer than ENERGY_MAX_GAP intervals is dropped
+ * instead and integration restarts from that reading, a guess over minutes or
+ * hours is no better than nothing and would overflow half_mw_ns eventually.
+ * Only called from the sampler.
+ */
+static void hxi_integrate(struct hxi_device *hxi)
+{
+	u64 max_gap = (u64)ENERGY_MAX_GAP * hxi->update_interval * NSEC_PER_MSEC;
+	u64 now = ktime_get_ns();
+	struct hxi_reading *reading;
+	struct hxi_energy *energy;
+	unsigned int seq;
+	u64 half_mw_ns;
+	bool good;
+	int mw;
+	int i;
+
+	for (i = 0; i < NUM_RAILS; i++) {
+		reading = &hxi->sample.watts[i];
+		energy = &hxi->counters->energy[i];
+		do {
+			seq = read_seqbegin(&hxi->sample_seq);
+			good = !reading->err && reading->valid;
+			mw = max(reading->value, 0);
+		} while (read_seqretry(&hxi->sample_seq, seq));
+		if (!good)
+			continue;
+
+		if (energy->stamp_ns && now - energy->stamp_ns <= max_gap) {
+			half_mw_ns = (u64)(energy->last_mw + mw) * (now - energy->stamp_ns) +
+				     energy->rem;
+			/* mW * ns is a nanojoule / 1000, i.e. a microjoule / 10^6 */
+			atomic64_add(div_u64_rem(half_mw_ns, 2 * NSEC_PER_MSEC, &energy->rem),
+				     &energy->uj);
+		}
+		energy->last_mw = mw;
+		energy->stamp_ns = now;
+	}
+}
+
+static u64 hxi_energy(struct hxi_counters *counters, int chan)
+{
+	return atomic64_read(&counters->energy[chan].uj);
+}
+
+static void hxi_counters_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct hxi_counters, kref));
+}
+
+static void hxi_snap(const struct hxi_reading *reading, int scale, s32 *value,
+		     u32 *valid, u32 bit)
+{
+	if (reading->err || !reading->valid)
+		return;
+
+	*value = reading->value * scale;
+	*valid |= bit;
+}
+
+/*
+ * Appends the result of the last sweep to the ring and wakes up its readers.
+ * mmap() readers see a slot's seq as HXI_RECORD_BUSY while it is rewritten,
+ * and the new head only once the record is complete.
+ */
+static void hxi_ring_push(struct hxi_device *hxi)
+{
+	struct hxi_ring *ring = hxi->ring;
+	struct hxi_sample *sample = &hxi->sample;
+	struct hxi_record rec, *slot;
+	unsigned int seq;
+	int i;
+
+	do {
+		seq = read_seqbegin(&hxi->sample_seq);
+		memset(&rec, 0, sizeof(rec));
+		for (i = 0; i < NUM_TEMPS; i++)
+			hxi_snap(&sample->temp[i], 1, &rec.temp[i], &rec.valid, HXI_VALID_TEMP(i));
+		for (i = 0; i < NUM_RAILS; i++) {
+			hxi_snap(&sample->volts[i], 1, &rec.in[i], &rec.valid, HXI_VALID_IN(i));
+			hxi_snap(&sample->watts[i], 1000, &rec.power[i], &rec.valid,
+				 HXI_VALID_POWER(i));
+		}
+		for (i = 0; i < NUM_RAILS - 1; i++)
+			hxi_snap(&sample->amps[i], 1, &rec.curr[i], &rec.valid, HXI_VALID_CURR(i));
+	} while (read_seqretry(&hxi->sample_seq, seq));
+	rec.seq = HXI_RECORD_BUSY;
+	rec.time_ns = ktime_get_ns();
+
+	mutex_lock(&ring->lock);
+	slot = &ring->records[ring->head & (RING_RECORDS - 1)];
+	WRITE_ONCE(slot->seq, HXI_RECORD_BUSY);
+	smp_wmb();
+	*slot = rec;
+	smp_wmb();
+	WRITE_ONCE(slot->seq, ring->head);
+	ring->head++;
+	smp_store_release(&ring->header->head, ring->head);
+	mutex_unlock(&ring->lock);
+
+	wake_up_interruptible_poll(&ring->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* reads a single byte setting, these are not cached */
+static int hxi_read_byte(struct hxi_device *hxi, u8 reg)
+{
+	struct hxi_request req;
+	int ret;
+
+	hxi_cmd(&req, 0x3, reg, 0);
+	mutex_lock(&hxi->mutex);
+	ret = send_usb_cmds(hxi, &req, 1);
+	mutex_unlock(&hxi->mutex);
+
+	return ret ? ret : req.reply[2];
+}
+
+static int hxi_write_byte(struct hxi_device *hxi, u8 reg, u8 val)
+{
+	struct hxi_request req;
+	int ret;
+
+	hxi_cmd(&req, 0x2, reg, val);
+	mutex_lock(&hxi->mutex);
+	ret = send_usb_cmds(hxi, &req, 1);
+	mutex_unlock(&hxi->mutex);
+
+	return ret;
+}
+
+/*
+ * Reads the over-current limit of each rail, which depends on the OCP mode.
+ * The limits don't change otherwise, so they are only read at probe and
+ * whenever the mode is changed.
+ */
+static void hxi_read_ocp_limits(struct hxi_device *hxi)
+{
+	struct hxi_request reqs[2];
+	enum hxi_sensor_id page;
+	int i, nr;
+
+	for (i = 0; i < NUM_RAILS - 1; i++) {
+		page = hxi->rails[i].sensor;
+		nr = 0;
+
+		mutex_lock(&hxi->mutex);
+		if (page != READ_ONCE(hxi->page)) {
+			hxi_cmd(&reqs[nr++], 0x2, 0x0, page);
+			WRITE_ONCE(hxi->page, page);
+		}
+		hxi_cmd(&reqs[nr++], 0x3, SIG_OCP_LIMIT, 0);
+		send_usb_cmds(hxi, reqs, nr);
+		if (nr > 1 && reqs[0].status)
+			WRITE_ONCE(hxi->page, SENSOR_UNKNOWN);
+		mutex_unlock(&hxi->mutex);
+
+		WRITE_ONCE(hxi->ocp_limit[i], get_data(&reqs[nr - 1]));
+	}
+}
+
+static void hxi_reply_str(struct hxi_request *req, char *str)
+{
+	if (req->status)
+		return;
+
+	/* NUL padded, but not necessarily NUL terminated */
+	scnprintf(str, REPLY_STR_LENGTH, "%.*s", IN_BUFFER_SIZE - 2, &req->reply[2]);
+}
+
+static s64 hxi_reply_u32(struct hxi_request *req)
+{
+	if (req->status)
+		return -1;
+
+	return ((u32)req->reply[5] << 24) + (req->reply[4] << 16) + (req->reply[3] << 8) +
+	       req->reply[2];
+}
+
+/* reads what doesn't change while the PSU is plugged in, see struct hxi_ident */
+static void hxi_read_ident(struct hxi_device *hxi)
+{
+	/* zeroed, a short reply must not leave stack garbage in the strings */
+	struct hxi_request reqs[5] = {};
+
+	hxi_cmd(&reqs[0], 0x3, SIG_VENDOR, 0);
+	hxi_cmd(&reqs[1], 0x3, SIG_PRODUCT, 0);
+	hxi_cmd(&reqs[2], 0x3, SIG_REVISION, 0);
+	hxi_cmd(&reqs[3], 0x3, SIG_TOTAL_UPTIME, 0);
+	hxi_cmd(&reqs[4], 0x3, SIG_UPTIME, 0);
+
+	mutex_lock(&hxi->mutex);
+	send_usb_cmds(hxi, reqs, ARRAY_SIZE(reqs));
+	mutex_unlock(&hxi->mutex);
+
+	hxi_reply_str(&reqs[0], hxi->ident.vendor);
+	hxi_reply_str(&reqs[1], hxi->ident.product);
+	hxi_reply_str(&reqs[2], hxi->ident.revision);
+	hxi->ident.total_uptime = hxi_reply_u32(&reqs[3]);
+	hxi->ident.uptime = hxi_reply_u32(&reqs[4]);
+	hxi->ident.stamp = jiffies;
+}
+
+static void hxi_iio_push(struct hxi_device *hxi);
+static void hxi_fan_curve_apply(struct hxi_device *hxi);
+
+static void hxi_sample_work(struct work_struct *work)
+{
+	struct hxi_device *hxi = container_of(to_delayed_work(work), struct hxi_device,
+					      sample_work);
+
+	hxi_sweep(hxi);
+	hxi_integrate(hxi);
+	hxi_ring_push(hxi);
+	hxi_iio_push(hxi);
+	hxi_fan_curve_apply(hxi);
+	schedule_delayed_work(&hxi->sample_work, msecs_to_jiffies(hxi->update_interval));
+}
+
+/*
+ * Stamps are taken when a sweep reads the sensor and the next sweep starts
+ * update_interval after the previous one ended, so a value is regularly a bit
+ * older than update_interval when it is replaced. Only a sweep that is a whole
+ * interval late makes it stale.
+ */
+static bool hxi_fresh(struct hxi_device *hxi, struct hxi_reading *reading)
+{
+	return time_before(jiffies, reading->stamp +
+			   2 * msecs_to_jiffies(hxi->update_interval));
+}
+
+/*
+ * Lockless read of a cached value, sets *fresh if hxi_fresh() says so. If the
+ * last attempt failed, the last good value is returned instead of the error as
+ * long as it is not older than max_stale.
+ */
+static int hxi_peek(struct hxi_device *hxi, struct hxi_reading *reading, bool *fresh)
+{
+	unsigned int seq;
+	int ret;
+
+	do {
+		seq = read_seqbegin(&hxi->sample_seq);
+		ret = reading->err ? reading->err : reading->value;
+		if (reading->err && reading->valid && max_stale &&
+		    time_before(jiffies, reading->good_stamp + msecs_to_jiffies(max_stale)))
+			ret = reading->value;
+		*fresh = hxi_fresh(hxi, reading);
+	} while (read_seqretry(&hxi->sample_seq, seq));
+
+	return ret;
+}
+
+/*
+ * Returns the last value of a sensor. Only if it is stale, e.g. because the
+ * background sweep is running late, it is read again first.
+ * Fresh values are read without taking any lock, so readers never wait for a
+ * transaction that is stuck in send_usb_cmd().
+ *
+ * The first reader to find a stale value marks it pending and refreshes it,
+ * everybody arriving in the meantime sleeps on refresh_wait and shares that
+ * result instead of queueing up on the mutex for a transaction of their own.
+ */
+static int hxi_cached(struct hxi_device *hxi, enum hwmon_sensor_types type, int chan)
+{
+	struct hxi_reading *reading = hxi_reading(hxi, type, chan);
+	const struct hxi_channel ch = { type, chan };
+	bool refresh = false;
+	bool fresh;
+	int ret;
+
+	ret = hxi_peek(hxi, reading, &fresh);
+	if (fresh)
+		return ret;
+
+	write_seqlock(&hxi->sample_seq);
+	if (!reading->pending && !hxi_fresh(hxi, reading)) {
+		reading->pending = true;
+		refresh = true;
+	}
+	write_sequnlock(&hxi->sample_seq);
+
+	if (refresh) {
+		mutex_lock(&hxi->mutex);
+		/* the sweep may have got here first while we waited */
+		if (!hxi_fresh(hxi, reading))
+			hxi_update(hxi, &ch, 1);
+		mutex_unlock(&hxi->mutex);
+
+		write_seqlock(&hxi->sample_seq);
+		reading->pending = false;
+		write_sequnlock(&hxi->sample_seq);
+		wake_up_all(&hxi->refresh_wait);
+	} else {
+		wait_event(hxi->refresh_wait, !READ_ONCE(reading->pending));
+	}
+
+	return hxi_peek(hxi, reading, &fresh);
+}
+
+static u8 hxi_fan_curve_pwm(const struct hxi_fan_curve *curve, int temp)
+{
+	int i;
+
+	if (temp <= curve->temp[0])
+		return curve->pwm[0];
+
+	/* temp[i - 1] <= temp < temp[i] even if the points are out of order */
+	for (i = 1; i < CURVE_POINTS; i++) {
+		if (temp < curve->temp[i])
+			return curve->pwm[i - 1] +
+			       (curve->pwm[i] - curve->pwm[i - 1]) * (temp - curve->temp[i - 1]) /
+			       (curve->temp[i] - curve->temp[i - 1]);
+	}
+
+	return curve->pwm[CURVE_POINTS - 1];
+}
+
+/*
+ * Sets the fan duty from the curve and the temperatures of the last sweep.
+ * The duty is only sent when it changes, and the fan runs at full speed while
+ * none of the temperatures can be read.
+ */
+static void hxi_fan_curve_apply(struct hxi_device *hxi)
+{
+	int temp = INT_MIN;
+	int value, pwm, duty;
+	bool fresh;
+	int i;
+
+	mutex_lock(&hxi->fan_lock);
+	if (!hxi->fan_curve)
+		goto out;
+
+	for (i = 0; i < NUM_TEMPS; i++) {
+		if (!(hxi->curve.channels & BIT(i)))
+			continue;
+		value = hxi_peek(hxi, &hxi->sample.temp[i], &fresh);
+		if (value >= 0)
+			temp = max(temp, value);
+	}
+
+	pwm = temp == INT_MIN ? 255 : hxi_fan_curve_pwm(&hxi->curve, temp);
+	duty = DIV_ROUND_CLOSEST(pwm * 100, 255);
+	if (duty != hxi->curve_duty)
+		hxi->curve_duty = hxi_write_byte(hxi, SIG_FAN_DUTY, duty) ? -1 : duty;
+out:
+	mutex_unlock(&hxi->fan_lock);
+}
+
+static int hxi_read_string(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, const char **str)
+{
+	int ret;
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+
+	switch (type) {
+	case hwmon_in:
+	case hwmon_curr:
+	case hwmon_power:
+		switch (attr) {
+		case hwmon_in_label: /* this includes current as well */
+		case hwmon_power_label:
+			*str = hxi->rails[channel].label;
+			ret = 0;
+			break;
+		default:
+			ret = -EOPNOTSUPP;
+			break;
+		}
+		break;
+	case hwmon_energy:
+		switch (attr) {
+		case hwmon_energy_label:
+			*str = hxi->rails[channel].label;
+			ret = 0;
+			break;
+		default:
+			ret = -EOPNOTSUPP;
+			break;
+		}
+		break;
+	default:
+		ret = -EOPNOTSUPP;
+		break;
+	}
+
+	return ret;
+}
+
+static int hxi_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int chan, long *val)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int ret = -EOPNOTSUPP;
+	int data;
+
+	switch (type) {
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			*val = hxi->update_interval;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_temp:
+		switch (attr) {
+		case hwmon_temp_input:
+			data = hxi_cached(hxi, type, chan);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			*val = data;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_in:
+		switch (attr) {
+		case hwmon_in_input:
+			data = hxi_cached(hxi, type, chan);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			*val = data;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_curr:
+		switch (attr) {
+		case hwmon_curr_input:
+			data = hxi_cached(hxi, type, chan);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			*val = data;
+			ret = 0;
+			break;
+		case hwmon_curr_crit:
+			data = READ_ONCE(hxi->ocp_limit[chan]);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			*val = data;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_power:
+		switch (attr) {
+		case hwmon_power_input:
+			data = hxi_cached(hxi, type, chan);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			/*power is reported in uW, more scaling needed */
+			*val = data * 1000;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_energy:
+		switch (attr) {
+		case hwmon_energy_input:
+			*val = hxi_energy(hxi->counters, chan);
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_fan:
+		switch (attr) {
+		case hwmon_fan_input:
+			data = hxi_cached(hxi, type, chan);
+			if (data < 0) {
+				ret = -ENODATA;
+				goto exit;
+			}
+			*val = data / 1000;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_input:
+			ret = hxi_read_byte(hxi, SIG_FAN_DUTY);
+			if (ret < 0)
+				goto exit;
+			*val = DIV_ROUND_CLOSEST(min(ret, 100) * 255, 100);
+			ret = 0;
+			break;
+		case hwmon_pwm_enable:
+			if (READ_ONCE(hxi->fan_curve)) {
+				*val = PWM_ENABLE_CURVE;
+				ret = 0;
+				break;
+			}
+			ret = hxi_read_byte(hxi, SIG_FAN_MODE);
+			if (ret < 0)
+				goto exit;
+			*val = ret == FAN_MODE_SOFTWARE ? PWM_ENABLE_MANUAL : PWM_ENABLE_HARDWARE;
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+exit:
+	return ret;
+}
+
+static int hxi_write(struct device *dev, enum hwmon_sensor_types type,
+		     u32 attr, int channel, long val)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int ret = -EOPNOTSUPP;
+
+	switch (type) {
+	case hwmon_chip:
+		switch (attr) {
+		case hwmon_chip_update_interval:
+			mutex_lock(&hxi->mutex);
+			hxi->update_interval = clamp_val(val, MIN_SAMPLE_INTERVAL,
+							 MAX_SAMPLE_INTERVAL);
+			mutex_unlock(&hxi->mutex);
+			mod_delayed_work(system_wq, &hxi->sample_work,
+					 msecs_to_jiffies(hxi->update_interval));
+			ret = 0;
+			break;
+		default:
+			break;
+		}
+		break;
+	case hwmon_pwm:
+		switch (attr) {
+		case hwmon_pwm_input:
+			if (val < 0 || val > 255) {
+				ret = -EINVAL;
+				break;
+			}
+			mutex_lock(&hxi->fan_lock);
+			/* the curve would override it on the next sweep */
+			if (hxi->fan_curve)
+				ret = -EBUSY;
+			else
+				ret = hxi_write_byte(hxi, SIG_FAN_DUTY, DIV_ROUND_CLOSEST(val * 100, 255));
+			mutex_unlock(&hxi->fan_lock);
+			break;
+		case hwmon_pwm_enable:
+			if (val != PWM_ENABLE_MANUAL && val != PWM_ENABLE_HARDWARE &&
+			    val != PWM_ENABLE_CURVE) {
+				ret = -EINVAL;
+				break;
+			}
+			mutex_lock(&hxi->fan_lock);
+			ret = hxi_write_byte(hxi, SIG_FAN_MODE, val == PWM_ENABLE_HARDWARE ?
+					     FAN_MODE_HARDWARE : FAN_MODE_SOFTWARE);
+			if (!ret) {
+				hxi->fan_curve = val == PWM_ENABLE_CURVE;
+				hxi->curve_duty = -1;
+			}
+			mutex_unlock(&hxi->fan_lock);
+			/* don't leave the fan at whatever duty was set last until the next sweep */
+			if (!ret && val == PWM_ENABLE_CURVE)
+				hxi_fan_curve_apply(hxi);
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+static umode_t hxi_is_visible(const void *data, enum hwmon_sensor_types type, u32 attr, int channel)
+{
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval)
+		return 0644;
+
+	if (type == hwmon_pwm)
+		return 0644;
+
+	return 0444;
+}
+
+static ssize_t pwm1_auto_point_temp_show(struct device *dev, struct device_attribute *attr,
+					 char *buf)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int nr = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(hxi->curve.temp[nr]));
+}
+
+static ssize_t pwm1_auto_point_temp_store(struct device *dev, struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int nr = to_sensor_dev_attr(attr)->index;
+	int ret;
+	int val;
+
+	ret = kstrtoint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&hxi->fan_lock);
+	hxi->curve.temp[nr] = clamp_val(val, 0, CURVE_MAX_TEMP);
+	mutex_unlock(&hxi->fan_lock);
+
+	return count;
+}
+
+static ssize_t pwm1_auto_point_pwm_show(struct device *dev, struct device_attribute *attr,
+					char *buf)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int nr = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(hxi->curve.pwm[nr]));
+}
+
+static ssize_t pwm1_auto_point_pwm_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int nr = to_sensor_dev_attr(attr)->index;
+	int ret;
+	u8 val;
+
+	ret = kstrtou8(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&hxi->fan_lock);
+	hxi->curve.pwm[nr] = val;
+	mutex_unlock(&hxi->fan_lock);
+
+	return count;
+}
+
+static ssize_t pwm1_auto_channels_temp_show(struct device *dev, struct device_attribute *attr,
+					    char *buf)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(hxi->curve.channels));
+}
+
+static ssize_t pwm1_auto_channels_temp_store(struct device *dev, struct device_attribute *attr,
+					     const char *buf, size_t count)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	/* a bit per temp*_input, at least one */
+	if (!val || val >= BIT(NUM_TEMPS))
+		return -EINVAL;
+
+	mutex_lock(&hxi->fan_lock);
+	hxi->curve.channels = val;
+	mutex_unlock(&hxi->fan_lock);
+
+	return count;
+}
+
+static ssize_t ocp_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	int ret;
+
+	ret = hxi_read_byte(hxi, SIG_OCP_MODE);
+	if (ret < 0)
+		return ret;
+
+	switch (ret) {
+	case OCP_MODE_SINGLE:
+		return sysfs_emit(buf, "single\n");
+	case OCP_MODE_MULTI:
+		return sysfs_emit(buf, "multi\n");
+	default:
+		return -ENODATA;
+	}
+}
+
+static ssize_t ocp_mode_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct hxi_device *hxi = dev_get_drvdata(dev);
+	enum hxi_ocp_mode mode;
+	int ret;
+
+	if (sysfs_streq(buf, "single"))
+		mode = OCP_MODE_SINGLE;
+	else if (sysfs_streq(buf, "multi"))
+		mode = OCP_MODE_MULTI;
+	else
+		return -EINVAL;
+
+	ret = hxi_write_byte(hxi, SIG_OCP_MODE, mode);
+	if (ret)
+		return ret;
+
+	hxi_read_ocp_limits(hxi);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(ocp_mode);
+
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point1_temp, pwm1_auto_point_temp, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point1_pwm, pwm1_auto_point_pwm, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point2_temp, pwm1_auto_point_temp, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point2_pwm, pwm1_auto_point_pwm, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point3_temp, pwm1_auto_point_temp, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point3_pwm, pwm1_auto_point_pwm, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point4_temp, pwm1_auto_point_temp, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point4_pwm, pwm1_auto_point_pwm, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point5_temp, pwm1_auto_point_temp, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm1_auto_point5_pwm, pwm1_auto_point_pwm, 4);
+static DEVICE_ATTR_RW(pwm1_auto_channels_temp);
+
+static struct attribute *hxi_attrs[] = {
+	&sensor_dev_attr_pwm1_auto_point1_temp.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point1_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point2_temp.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point2_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point3_temp.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point3_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point4_temp.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point4_pwm.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point5_temp.dev_attr.attr,
+	&sensor_dev_attr_pwm1_auto_point5_pwm.dev_attr.attr,
+	&dev_attr_pwm1_auto_channels_temp.attr,
+	&dev_attr_ocp_mode.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(hxi);
+
+static const struct hwmon_ops hxi_hwmon_ops = {
+	.is_visible = hxi_is_visible,
+	.read = hxi_read,
+	.read_string = hxi_read_string,
+	.write = hxi_write,
+};
+
+static const struct hwmon_channel_info *hxi_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ | HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT,
+			   HWMON_T_INPUT
+	),
+	HWMON_CHANNEL_INFO(in,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL,
+			   HWMON_I_INPUT | HWMON_I_LABEL
+	),
+	HWMON_CHANNEL_INFO(curr,
+			   HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_CRIT,
+			   HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_CRIT,
+			   HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_CRIT
+	),
+	HWMON_CHANNEL_INFO(power,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL,
+			   HWMON_P_INPUT | HWMON_P_LABEL
+	),
+	HWMON_CHANNEL_INFO(energy,
+			   HWMON_E_INPUT | HWMON_E_LABEL,
+			   HWMON_E_INPUT | HWMON_E_LABEL,
+			   HWMON_E_INPUT | HWMON_E_LABEL,
+			   HWMON_E_INPUT | HWMON_E_LABEL
+	),
+	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT),
+	HWMON_CHANNEL_INFO(pwm, HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+	NULL
+};
+
+static const struct hwmon_chip_info hxi_chip_info = {
+	.ops = &hxi_hwmon_ops,
+	.info = hxi_info,
+};
+
+/* age of the value every hwmon *_input is served from */
+static int sample_age_show(struct seq_file *seqf, void *unused)
+{
+	static const char * const names[] = {
+		[hwmon_temp] = "temp",
+		[hwmon_in] = "in",
+		[hwmon_curr] = "curr",
+		[hwmon_power] = "power",
+		[hwmon_fan] = "fan",
+	};
+	static const struct hxi_channel chans[] = {
+		{ hwmon_temp, 0 }, { hwmon_temp, 1 },
+		{ hwmon_in, 0 }, { hwmon_in, 1 }, { hwmon_in, 2 }, { hwmon_in, 3 },
+		{ hwmon_curr, 0 }, { hwmon_curr, 1 }, { hwmon_curr, 2 },
+		{ hwmon_power, 0 }, { hwmon_power, 1 }, { hwmon_power, 2 }, { hwmon_power, 3 },
+		{ hwmon_fan, 0 },
+	};
+	struct hxi_device *hxi = seqf->private;
+	struct hxi_reading *reading;
+	unsigned long good_stamp;
+	unsigned int seq;
+	bool valid;
+	int err;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chans); i++) {
+		reading = hxi_reading(hxi, chans[i].type, chans[i].chan);
+		do {
+			seq = read_seqbegin(&hxi->sample_seq);
+			valid = reading->valid;
+			good_stamp = reading->good_stamp;
+			err = reading->err;
+		} while (read_seqretry(&hxi->sample_seq, seq));
+
+		/* hwmon numbers in* from 0 and everything else from 1 */
+		seq_printf(seqf, "%s%d_input ", names[chans[i].type],
+			   chans[i].chan + (chans[i].type != hwmon_in));
+		if (valid)
+			seq_printf(seqf, "%u ms", jiffies_to_msecs(jiffies - good_stamp));
+		else
+			seq_puts(seqf, "never");
+		if (err)
+			seq_printf(seqf, ", last read failed: %d", err);
+		seq_puts(seqf, "\n");
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sample_age);
+
+static int ident_show(struct seq_file *seqf, void *unused)
+{
+	struct hxi_device *hxi = seqf->private;
+	struct hxi_ident *ident = &hxi->ident;
+	/* the counters were read at probe, they have been running since */
+	s64 since = (jiffies - ident->stamp) / HZ;
+
+	seq_printf(seqf, "vendor: %s\n", ident->vendor);
+	seq_printf(seqf, "product: %s\n", ident->product);
+	seq_printf(seqf, "revision: %s\n", ident->revision);
+	if (ident->total_uptime >= 0)
+		seq_printf(seqf, "total_uptime: %lld\n", ident->total_uptime + since);
+	if (ident->uptime >= 0)
+		seq_printf(seqf, "uptime: %lld\n", ident->uptime + since);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ident);
+
+static void hxi_debugfs_init(struct hxi_device *hxi)
+{
+	char name[32];
+
+	scnprintf(name, sizeof(name), "%s-%s", DRIVER_NAME, dev_name(&hxi->hdev->dev));
+
+	hxi->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_u32("transactions", 0444, hxi->debugfs, &hxi->transactions);
+	debugfs_create_u32("reply_mismatches", 0444, hxi->debugfs, &hxi->reply_mismatches);
+	debugfs_create_u32("srtt_us", 0444, hxi->debugfs, &hxi->srtt_us);
+	debugfs_create_u32("rttvar_us", 0444, hxi->debugfs, &hxi->rttvar_us);
+	debugfs_create_u32("timeout_us", 0444, hxi->debugfs, &hxi->timeout_us);
+	debugfs_create_u32("retried", 0444, hxi->debugfs, &hxi->retried);
+	debugfs_create_file("sample_age", 0444, hxi->debugfs, hxi, &sample_age_fops);
+	debugfs_create_file("ident", 0444, hxi->debugfs, hxi, &ident_fops);
+}
+
+#ifdef CONFIG_PERF_EVENTS
+/*
+ * A perf PMU per PSU, counting the energy of a rail or the wall input in
+ * microjoules, e.g. perf stat -a -e hxipsu0/energy-wall/. Like RAPL, the
+ * counters are system wide and only counted on one CPU, which is advertised in
+ * cpumask and moved to another one when it goes offline.
+ *
+ * Events only hold a reference to the counters, not to the PSU, so they can
+ * be read until they are closed, they just stop counting once it is removed.
+ */
+static int hxi_cpuhp_state = -ENODEV;
+
+static struct hxi_counters *hxi_from_pmu(struct pmu *pmu)
+{
+	return container_of(pmu, struct hxi_counters, pmu);
+}
+
+static void hxi_pmu_event_update(struct perf_event *event)
+{
+	u64 now = hxi_energy(hxi_from_pmu(event->pmu), event->attr.config);
+	u64 prev = local64_xchg(&event->hw.prev_count, now);
+
+	local64_add(now - prev, &event->count);
+}
+
+static void hxi_pmu_event_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count,
+		    hxi_energy(hxi_from_pmu(event->pmu), event->attr.config));
+}
+
+static void hxi_pmu_event_stop(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_UPDATE)
+		hxi_pmu_event_update(event);
+}
+
+static int hxi_pmu_event_add(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_START)
+		hxi_pmu_event_start(event, flags);
+
+	return 0;
+}
+
+static void hxi_pmu_event_del(struct perf_event *event, int flags)
+{
+	hxi_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static void hxi_pmu_event_destroy(struct perf_event *event)
+{
+	kref_put(&hxi_from_pmu(event->pmu)->kref, hxi_counters_free);
+}
+
+static int hxi_pmu_event_init(struct perf_event *event)
+{
+	struct hxi_counters *counters = hxi_from_pmu(event->pmu);
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	if (event->attr.config >= NUM_RAILS)
+		return -EINVAL;
+
+	/* only counting the whole system is supported */
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK ||
+	    event->cpu < 0)
+		return -EINVAL;
+
+	event->cpu = READ_ONCE(counters->cpu);
+	kref_get(&counters->kref);
+	event->destroy = hxi_pmu_event_destroy;
+
+	return 0;
+}
+
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hxi_counters *counters = hxi_from_pmu(dev_get_drvdata(dev));
+
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(READ_ONCE(counters->cpu)));
+}
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *hxi_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static const struct attribute_group hxi_pmu_cpumask_group = {
+	.attrs = hxi_pmu_cpumask_attrs,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *hxi_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static const struct attribute_group hxi_pmu_format_group = {
+	.name = "format",
+	.attrs = hxi_pmu_format_attrs,
+};
+
+/* the event numbers are the hwmon energy channels */
+PMU_EVENT_ATTR_STRING(energy-12v, hxi_pmu_12v, "event=0x00");
+PMU_EVENT_ATTR_STRING(energy-5v, hxi_pmu_5v, "event=0x01");
+PMU_EVENT_ATTR_STRING(energy-3v, hxi_pmu_3v, "event=0x02");
+PMU_EVENT_ATTR_STRING(energy-wall, hxi_pmu_wall, "event=0x03");
+PMU_EVENT_ATTR_STRING(energy-12v.unit, hxi_pmu_12v_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy-5v.unit, hxi_pmu_5v_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy-3v.unit, hxi_pmu_3v_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy-wall.unit, hxi_pmu_wall_unit, "Joules");
+PMU_EVENT_ATTR_STRING(energy-12v.scale, hxi_pmu_12v_scale, "1e-6");
+PMU_EVENT_ATTR_STRING(energy-5v.scale, hxi_pmu_5v_scale, "1e-6");
+PMU_EVENT_ATTR_STRING(energy-3v.scale, hxi_pmu_3v_scale, "1e-6");
+PMU_EVENT_ATTR_STRING(energy-wall.scale, hxi_pmu_wall_scale, "1e-6");
+
+static struct attribute *hxi_pmu_events_attrs[] = {
+	&hxi_pmu_12v.attr.attr,
+	&hxi_pmu_5v.attr.attr,
+	&hxi_pmu_3v.attr.attr,
+	&hxi_pmu_wall.attr.attr,
+	&hxi_pmu_12v_unit.attr.attr,
+	&hxi_pmu_5v_unit.attr.attr,
+	&hxi_pmu_3v_unit.attr.attr,
+	&hxi_pmu_wall_unit.attr.attr,
+	&hxi_pmu_12v_scale.attr.attr,
+	&hxi_pmu_5v_scale.attr.attr,
+	&hxi_pmu_3v_scale.attr.attr,
+	&hxi_pmu_wall_scale.attr.attr,
+	NULL,
+};
+
+static const struct attribute_group hxi_pmu_events_group = {
+	.name = "events",
+	.attrs = hxi_pmu_events_attrs,
+};
+
+static const struct attribute_group *hxi_pmu_attr_groups[] = {
+	&hxi_pmu_cpumask_group,
+	&hxi_pmu_format_group,
+	&hxi_pmu_events_group,
+	NULL,
+};
+
+/* the first CPU to come online counts, see hxi_pmu_register() */
+static int hxi_pmu_online_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct hxi_counters *counters = hlist_entry(node, struct hxi_counters, node);
+
+	if (counters->cpu >= nr_cpu_ids)
+		WRITE_ONCE(counters->cpu, cpu);
+
+	return 0;
+}
+
+static int hxi_pmu_offline_cpu(unsigned int cpu, struct hlist_node *node)
+{
+	struct hxi_counters *counters = hlist_entry(node, struct hxi_counters, node);
+	unsigned int target;
+
+	if (cpu != counters->cpu)
+		return 0;
+
+	target = cpumask_any_but(cpu_online_mask, cpu);
+	if (target >= nr_cpu_ids)
+		return 0;
+
+	WRITE_ONCE(counters->cpu, target);
+	perf_pmu_migrate_context(&counters->pmu, cpu, target);
+
+	return 0;
+}
+
+static void hxi_pmu_register(struct hxi_device *hxi)
+{
+	struct hxi_counters *counters = hxi->counters;
+	int ret;
+
+	if (hxi_cpuhp_state < 0) {
+		ret = hxi_cpuhp_state;
+		goto fail;
+	}
+
+	counters->cpu = nr_cpu_ids;
+	counters->pmu = (struct pmu) {
+		.module = THIS_MODULE,
+		.attr_groups = hxi_pmu_attr_groups,
+		.task_ctx_nr = perf_invalid_context,
+		.capabilities = PERF_PMU_CAP_NO_EXCLUDE,
+		.event_init = hxi_pmu_event_init,
+		.add = hxi_pmu_event_add,
+		.del = hxi_pmu_event_del,
+		.start = hxi_pmu_event_start,
+		.stop = hxi_pmu_event_stop,
+		.read = hxi_pmu_event_update,
+	};
+
+	/* picks the CPU through hxi_pmu_online_cpu() */
+	ret = cpuhp_state_add_instance(hxi_cpuhp_state, &counters->node);
+	if (ret)
+		goto fail;
+
+	ret = perf_pmu_register(&counters->pmu, hxi->ring->name, -1);
+	if (ret) {
+		cpuhp_state_remove_instance_nocalls(hxi_cpuhp_state, &counters->node);
+		goto fail;
+	}
+
+	counters->registered = true;
+	return;
+
+fail:
+	hid_warn(hxi->hdev, "failed to register perf PMU: %d\n", ret);
+}
+
+static void hxi_pmu_unregister(struct hxi_device *hxi)
+{
+	struct hxi_counters *counters = hxi->counters;
+
+	if (!counters->registered)
+		return;
+
+	perf_pmu_unregister(&counters->pmu);
+	cpuhp_state_remove_instance_nocalls(hxi_cpuhp_state, &counters->node);
+}
+
+static void hxi_pmu_init(void)
+{
+	hxi_cpuhp_state = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN, "perf/hxipsu:online",
+						  hxi_pmu_online_cpu, hxi_pmu_offline_cpu);
+}
+
+static void hxi_pmu_exit(void)
+{
+	if (hxi_cpuhp_state >= 0)
+		cpuhp_remove_multi_state(hxi_cpuhp_state);
+}
+#else
+static void hxi_pmu_register(struct hxi_device *hxi) {}
+static void hxi_pmu_unregister(struct hxi_device *hxi) {}
+static void hxi_pmu_init(void) {}
+static void hxi_pmu_exit(void) {}
+#endif
+
+#if IS_REACHABLE(CONFIG_POWERCAP)
+/*
+ * A powercap control type per PSU, so tools that read RAPL through powercap
+ * also see the platform power. The wall input is the top level zone, the rails
+ * it feeds are its children. The zones only report energy and power, the PSU
+ * can't be capped.
+ */
+static int hxi_zone_get_energy_uj(struct powercap_zone *zone, u64 *energy_uj)
+{
+	struct hxi_zone *z = powercap_get_zone_data(zone);
+
+	/* the zone is visible before hxi_powercap_register() set its data */
+	if (!z)
+		return -ENODATA;
+
+	*energy_uj = hxi_energy(z->hxi->counters, z->chan);
+	return 0;
+}
+
+static int hxi_zone_get_max_energy_range_uj(struct powercap_zone *zone, u64 *range_uj)
+{
+	*range_uj = U64_MAX;
+	return 0;
+}
+
+static int hxi_zone_get_power_uw(struct powercap_zone *zone, u64 *power_uw)
+{
+	struct hxi_zone *z = powercap_get_zone_data(zone);
+	int mw;
+
+	if (!z)
+		return -ENODATA;
+
+	mw = hxi_cached(z->hxi, hwmon_power, z->chan);
+	if (mw < 0)
+		return -ENODATA;
+
+	*power_uw = (u64)mw * 1000;
+	return 0;
+}
+
+static const struct powercap_zone_ops hxi_zone_ops = {
+	.get_max_energy_range_uj = hxi_zone_get_max_energy_range_uj,
+	.get_energy_uj = hxi_zone_get_energy_uj,
+	.get_power_uw = hxi_zone_get_power_uw,
+};
+
+/*
+ * powercap_register_zone() insists on constraint ops even for zones without
+ * constraints, these are never called.
+ */
+static int hxi_zone_set_limit(struct powercap_zone *zone, int id, u64 value)
+{
+	return -EOPNOTSUPP;
+}
+
+static int hxi_zone_get_limit(struct powercap_zone *zone, int id, u64 *value)
+{
+	return -EOPNOTSUPP;
+}
+
+static const struct powercap_zone_constraint_ops hxi_zone_constraint_ops = {
+	.set_power_limit_uw = hxi_zone_set_limit,
+	.get_power_limit_uw = hxi_zone_get_limit,
+	.set_time_window_us = hxi_zone_set_limit,
+	.get_time_window_us = hxi_zone_get_limit,
+};
+
+static void hxi_powercap_unregister(struct hxi_device *hxi)
+{
+	int i;
+
+	if (IS_ERR_OR_NULL(hxi->powercap))
+		return;
+
+	/* children first, the wall zone is the last rail */
+	for (i = 0; i < NUM_RAILS; i++) {
+		if (hxi->zones[i].zone)
+			powercap_unregister_zone(hxi->powercap, hxi->zones[i].zone);
+	}
+	powercap_unregister_control_type(hxi->powercap);
+}
+
+static void hxi_powercap_register(struct hxi_device *hxi)
+{
+	struct powercap_zone *wall = NULL;
+	struct powercap_zone *zone;
+	int i, chan;
+
+	hxi->powercap = powercap_register_control_type(NULL, hxi->ring->name, NULL);
+	if (IS_ERR(hxi->powercap)) {
+		hid_warn(hxi->hdev, "failed to register powercap control type: %ld\n",
+			 PTR_ERR(hxi->powercap));
+		return;
+	}
+
+	for (i = 0; i < NUM_RAILS; i++) {
+		/* the wall zone has to exist before the rails below it */
+		chan = (i + NUM_RAILS - 1) % NUM_RAILS;
+		hxi->zones[chan].hxi = hxi;
+		hxi->zones[chan].chan = chan;
+		zone = powercap_register_zone(NULL, hxi->powercap, hxi->rails[chan].label,
+					      wall, &hxi_zone_ops, 0, &hxi_zone_constraint_ops);
+		if (IS_ERR(zone)) {
+			hid_warn(hxi->hdev, "failed to register powercap zone %s: %ld\n",
+				 hxi->rails[chan].label, PTR_ERR(zone));
+			hxi_powercap_unregister(hxi);
+			hxi->powercap = NULL;
+			return;
+		}
+		powercap_set_zone_data(zone, &hxi->zones[chan]);
+		hxi->zones[chan].zone = zone;
+		if (!wall)
+			wall = zone;
+	}
+}
+#else
+static void hxi_powercap_register(struct hxi_device *hxi) {}
+static void hxi_powercap_unregister(struct hxi_device *hxi) {}
+#endif
+
+#if IS_REACHABLE(CONFIG_IIO_KFIFO_BUF)
+/*
+ * An IIO device with every sensor as a channel, in the order of the ring
+ * records. Its buffer is filled by the sampler after every sweep, so the
+ * sample rate is update_interval and streaming costs no extra USB traffic.
+ * The values are already in IIO units, hence processed channels.
+ */
+#define HXI_IIO_CHAN(_type, _chan, _index) {				\
+	.type = (_type),						\
+	.indexed = 1,							\
+	.channel = (_chan),						\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),		\
+	.scan_index = (_index),						\
+	.scan_type = {							\
+		.sign = 's',						\
+		.realbits = 32,						\
+		.storagebits = 32,					\
+		.endianness = IIO_CPU,					\
+	},								\
+}
+
+#define HXI_IIO_CHANNELS 13
+
+static const struct iio_chan_spec hxi_iio_channels[] = {
+	HXI_IIO_CHAN(IIO_TEMP, 0, 0),
+	HXI_IIO_CHAN(IIO_TEMP, 1, 1),
+	HXI_IIO_CHAN(IIO_VOLTAGE, 0, 2),
+	HXI_IIO_CHAN(IIO_VOLTAGE, 1, 3),
+	HXI_IIO_CHAN(IIO_VOLTAGE, 2, 4),
+	HXI_IIO_CHAN(IIO_VOLTAGE, 3, 5),
+	HXI_IIO_CHAN(IIO_CURRENT, 0, 6),
+	HXI_IIO_CHAN(IIO_CURRENT, 1, 7),
+	HXI_IIO_CHAN(IIO_CURRENT, 2, 8),
+	HXI_IIO_CHAN(IIO_POWER, 0, 9),
+	HXI_IIO_CHAN(IIO_POWER, 1, 10),
+	HXI_IIO_CHAN(IIO_POWER, 2, 11),
+	HXI_IIO_CHAN(IIO_POWER, 3, 12),
+	IIO_CHAN_SOFT_TIMESTAMP(HXI_IIO_CHANNELS),
+};
+
+/* sweeps always read everything, the IIO core picks what the buffer wants */
+static const unsigned long hxi_iio_scan_masks[] = {
+	GENMASK(HXI_IIO_CHANNELS - 1, 0),
+	0
+};
+
+static enum hwmon_sensor_types hxi_iio_hwmon_type(const struct iio_chan_spec *chan)
+{
+	switch (chan->type) {
+	case IIO_TEMP:
+		return hwmon_temp;
+	case IIO_VOLTAGE:
+		return hwmon_in;
+	case IIO_CURRENT:
+		return hwmon_curr;
+	default:
+		return hwmon_power;
+	}
+}
+
+static int hxi_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+			    int *val, int *val2, long mask)
+{
+	struct hxi_device *hxi = iio_device_get_drvdata(indio_dev);
+	int data;
+
+	if (mask != IIO_CHAN_INFO_PROCESSED)
+		return -EINVAL;
+
+	data = hxi_cached(hxi, hxi_iio_hwmon_type(chan), chan->channel);
+	if (data < 0)
+		return -ENODATA;
+
+	*val = data;
+	return IIO_VAL_INT;
+}
+
+static int hxi_iio_read_label(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+			      char *label)
+{
+	struct hxi_device *hxi = iio_device_get_drvdata(indio_dev);
+
+	if (chan->type == IIO_TEMP)
+		return -EINVAL;
+
+	return sysfs_emit(label, "%s\n", hxi->rails[chan->channel].label);
+}
+
+static const struct iio_info hxi_iio_info = {
+	.read_raw = hxi_iio_read_raw,
+	.read_label = hxi_iio_read_label,
+};
+
+static void hxi_iio_push(struct hxi_device *hxi)
+{
+	struct hxi_sample *sample = &hxi->sample;
+	struct {
+		s32 values[HXI_IIO_CHANNELS];
+		s64 timestamp __aligned(8);
+	} scan;
+	unsigned int seq;
+	s32 *v;
+	int i;
+
+	if (!hxi->iio || !iio_buffer_enabled(hxi->iio))
+		return;
+
+	memset(&scan, 0, sizeof(scan));
+	do {
+		seq = read_seqbegin(&hxi->sample_seq);
+		/* the last good value of a sensor that failed this time */
+		v = scan.values;
+		for (i = 0; i < NUM_TEMPS; i++)
+			*v++ = sample->temp[i].value;
+		for (i = 0; i < NUM_RAILS; i++)
+			*v++ = sample->volts[i].value;
+		for (i = 0; i < NUM_RAILS - 1; i++)
+			*v++ = sample->amps[i].value;
+		for (i = 0; i < NUM_RAILS; i++)
+			*v++ = sample->watts[i].value;
+	} while (read_seqretry(&hxi->sample_seq, seq));
+
+	iio_push_to_buffers_with_timestamp(hxi->iio, &scan, iio_get_time_ns(hxi->iio));
+}
+
+/*
+ * Built against a kernel with IIO as modules, this module needs industrialio
+ * and industrialio-kfifo-buf loaded, whether a PSU is ever probed or not.
+ */
+static void hxi_iio_register(struct hxi_device *hxi)
 {
-	unsigned long t;
+	struct iio_dev *indio_dev;
 	int ret;
 
-	memset(hxi->buffer, 0x00, OUT_BUFFER_SIZE);
-	hxi->buffer[0] = command;
-	hxi->buffer[1] = b1;
-	hxi->buffer[2] = b2;
+	indio_dev = devm_iio_device_alloc(&hxi->hdev->dev, 0);
+	if (!indio_dev) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
-	reinit_completion(&hxi->wait_input_report);
+	iio_device_set_drvdata(indio_dev, hxi);
+	indio_dev->name = "hxipsu";
+	indio_dev->info = &hxi_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = hxi_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(hxi_iio_channels);
+	indio_dev->available_scan_masks = hxi_iio_scan_masks;
 
-	ret = hid_hw_output_report(hxi->hdev, hxi->buffer, OUT_BUFFER_SIZE);
-	if (ret < 0)
-		goto exit;
-	else
-		ret = 0;
-	t = wait_for_completion_timeout(&hxi->wait_input_report, msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t)
-		ret = -ETIMEDOUT;
+	ret = devm_iio_kfifo_buffer_setup(&hxi->hdev->dev, indio_dev, NULL);
+	if (ret)
+		goto fail;
 
-exit:
-	return ret;
+	/* not devm, it has to be gone before the PSU stops answering */
+	ret = iio_device_register(indio_dev);
+	if (ret)
+		goto fail;
+
+	hxi->iio = indio_dev;
+	return;
+
+fail:
+	hid_warn(hxi->hdev, "failed to register IIO device: %d\n", ret);
 }
 
-static int hxi_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
+static void hxi_iio_unregister(struct hxi_device *hxi)
 {
-	struct hxi_device *hxi = hid_get_drvdata(hdev);
+	if (hxi->iio)
+		iio_device_unregister(hxi->iio);
+}
+#else
+static void hxi_iio_push(struct hxi_device *hxi) {}
+static void hxi_iio_register(struct hxi_device *hxi) {}
+static void hxi_iio_unregister(struct hxi_device *hxi) {}
+#endif
 
-	/* only copy buffer when requested */
-	if (completion_done(&hxi->wait_input_report))
-		goto exit;
+static DEFINE_IDA(hxi_ida);
 
-	memcpy(hxi->buffer, data, min(IN_BUFFER_SIZE, size));
-	complete(&hxi->wait_input_report);
+static void hxi_ring_free(struct kref *kref)
+{
+	struct hxi_ring *ring = container_of(kref, struct hxi_ring, kref);
 
-exit:
-	return 0;
+	vfree(ring->header);
+	kfree(ring);
 }
 
 /*
- * Gets one of the two temperature sensors in the PSU
- * This code is different enough from the other sensors to justify pulling it out into it's own
- * function to improve readability.
+ * A new reader starts with the oldest record still in the ring, so it gets
+ * the recent history right away.
  */
-static int get_temperature(struct hxi_device *hxi, int channel)
+static int hxi_ring_open(struct inode *inode, struct file *file)
 {
-	int ret;
-	u8 cmd = SIG_TEMPERATURE_1;
+	/* misc_open() hands us the miscdevice, misc_deregister() can't run now */
+	struct hxi_ring *ring = container_of(file->private_data, struct hxi_ring, misc);
+	struct hxi_reader *reader;
 
-	if (channel == 1)
-		cmd = SIG_TEMPERATURE_2;
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
 
-	mutex_lock(&hxi->mutex);
-	ret = send_usb_cmd(hxi, 0x03, cmd, 0);
-	if (ret)
-		ret = -ENODATA;
-	else
-		ret = (hxi->buffer[2] << 8) + hxi->buffer[3];
-	mutex_unlock(&hxi->mutex);
+	kref_get(&ring->kref);
+	reader->ring = ring;
+	mutex_lock(&ring->lock);
+	reader->pos = ring->head > RING_RECORDS ? ring->head - RING_RECORDS : 0;
+	mutex_unlock(&ring->lock);
+	file->private_data = reader;
+	/* seeking moves pos, see hxi_ring_llseek(), but there is no pread() */
+	file->f_mode &= ~(FMODE_PREAD | FMODE_PWRITE);
 
-	return ret;
+	return 0;
+}
+
+static int hxi_ring_release(struct inode *inode, struct file *file)
+{
+	struct hxi_reader *reader = file->private_data;
+
+	kref_put(&reader->ring->kref, hxi_ring_free);
+	kfree(reader);
+
+	return 0;
 }
 
 /*
- * The PSU reports voltage/current/power measurements in this 16-bit
- * floating-point format as described in the
- * PMBUS spec, v1.2, Part II, section 8.3.1
+ * Copies as many whole records as fit into buf, starting at the reader's
+ * position. Blocks until the next sweep if there is nothing new. A reader that
+ * fell behind by more than the ring holds skips the lost records, which shows
+ * as a jump in seq.
  *
- * There is already code for this in the PMBus section of hwmon, but I didn't
- * want this module to depend on any of the PMBus components because PMBus is
- * so heavily tied in with I2C, and this is a USBHID driver.
+ * Records are copied out of the ring into a bounce buffer under ring->lock and
+ * only then to userspace, so a user buffer that faults slowly never holds up
+ * the sampler in hxi_ring_push().
  */
-static int decode_corsair_float(u16 input)
+static ssize_t hxi_ring_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-	int ret;
-	int exponent = input >> 11;
-	int fraction = input & 2047;
-
-	if (exponent > 15)
-		exponent = -(32 - exponent);
-	if (fraction > 1023)
-		fraction = -(2048 - fraction);
-	if (fraction & 1)
-		fraction++;
-	/* scale to milli-units */
-	fraction = fraction * 1000;
-	if (exponent < 0)
-		ret = fraction >> ((~exponent) + 1);
-	else
-		ret = fraction << exponent;
+	struct hxi_reader *reader = file->private_data;
+	struct hxi_ring *ring = reader->ring;
+	struct hxi_record *bounce;
+	size_t i, n, done, left, copied = 0;
+	ssize_t ret;
+	u64 start;
+
+	if (count < sizeof(struct hxi_record))
+		return -EINVAL;
+
+	count /= sizeof(struct hxi_record);
+	bounce = kmalloc_array(min_t(size_t, count, READ_BATCH), sizeof(*bounce), GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	mutex_lock(&ring->lock);
+	while (reader->pos == ring->head) {
+		mutex_unlock(&ring->lock);
+		if (READ_ONCE(ring->dead)) {
+			ret = -ENODEV;
+			goto out_free;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out_free;
+		}
+		ret = wait_event_interruptible(ring->wait, READ_ONCE(ring->head) != reader->pos ||
+					       READ_ONCE(ring->dead));
+		if (ret)
+			goto out_free;
+		mutex_lock(&ring->lock);
+	}
+
+	while (count) {
+		if (ring->head - reader->pos > RING_RECORDS)
+			reader->pos = ring->head - RING_RECORDS;
+
+		n = min_t(size_t, count, min_t(u64, ring->head - reader->pos, READ_BATCH));
+		if (!n)
+			break;
+		for (i = 0; i < n; i++)
+			bounce[i] = ring->records[(reader->pos + i) & (RING_RECORDS - 1)];
+		start = reader->pos;
+		reader->pos += n;
+		mutex_unlock(&ring->lock);
+
+		left = copy_to_user(buf + copied, bounce, n * sizeof(*bounce));
+		if (left) {
+			/* records that didn't make it out are returned by the next read() */
+			done = n - DIV_ROUND_UP(left, sizeof(*bounce));
+			mutex_lock(&ring->lock);
+			if (reader->pos == start + n)
+				reader->pos = start + done;
+			mutex_unlock(&ring->lock);
+			copied += done * sizeof(*bounce);
+			ret = copied ? copied : -EFAULT;
+			goto out_free;
+		}
+		copied += n * sizeof(*bounce);
+		count -= n;
+		mutex_lock(&ring->lock);
+	}
+	mutex_unlock(&ring->lock);
+	ret = copied;
+
+out_free:
+	kfree(bounce);
 	return ret;
 }
 
+/* maps the header page and the records behind it, read-only */
+static int hxi_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct hxi_reader *reader = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, reader->ring->header, vma->vm_pgoff);
+}
+
 /*
- * Requests and returns single data values depending on channel.
- * To maintain PMBUS-like behavior, the PSU switches "channels" when taking
- * measurements from the 12V/5V/3.3V busses. Other sensors that have standard
- * PMBUS commands are "unswitched"
+ * The file position is the seq of the next record read() returns. A consumer
+ * that follows the ring through mmap() seeks past the records it has seen,
+ * e.g. with lseek(fd, 0, SEEK_END), which is what hxi_ring_poll() goes by.
  */
-static int get_data(struct hxi_device *hxi, enum hxi_sensor_id sensor, enum hxi_sensor_cmd sig)
+static loff_t hxi_ring_llseek(struct file *file, loff_t offset, int whence)
 {
-	int ret;
+	struct hxi_reader *reader = file->private_data;
+	struct hxi_ring *ring = reader->ring;
+	loff_t pos;
 
-	mutex_lock(&hxi->mutex);
-	switch (sensor) {
-	case SENSOR_12V:
-	case SENSOR_5V:
-	case SENSOR_3V:
-		ret = send_usb_cmd(hxi, 0x2, 0x0, sensor);
-		break;
-	case UNSWITCHED:
-		ret = 0;
+	mutex_lock(&ring->lock);
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
 		break;
-	default:
-		ret = -EOPNOTSUPP;
+	case SEEK_CUR:
+		pos = reader->pos + offset;
 		break;
-	}
-	if (ret)
-		goto out_unlock;
-	switch (sig) {
-	case SIG_VOLTS:
-	case SIG_AMPS:
-	case SIG_WATTS:
-	case SIG_TOTAL_WATTS:
-	case SIG_WALL_VOLTS:
-		ret = send_usb_cmd(hxi, 0x3, sig, 0);
+	case SEEK_END:
+		pos = ring->head + offset;
 		break;
 	default:
-		ret = -1;
-		break;
-	}
-	if (ret)
+		pos = -EINVAL;
 		goto out_unlock;
-	/*
-	 * Note that this is different byte order from temperature.
-	 * Thanks, PMBus.
-	 */
-	ret = (hxi->buffer[3] << 8) + hxi->buffer[2];
+	}
+
+	if (pos < 0 || pos > ring->head)
+		pos = -EINVAL;
+	else
+		reader->pos = pos;
 
 out_unlock:
-	mutex_unlock(&hxi->mutex);
-	return decode_corsair_float((u16)ret);
+	mutex_unlock(&ring->lock);
+	return pos;
 }
 
-static int hxi_read_string(struct device *dev, enum hwmon_sensor_types type,
-			   u32 attr, int channel, const char **str)
+/*
+ * Readable while there are records before the head that the file hasn't
+ * moved past yet, by read() or lseek(). Polling itself never changes that,
+ * as the kernel polls in more places than the wait a consumer sleeps in.
+ */
+static __poll_t hxi_ring_poll(struct file *file, poll_table *wait)
 {
-	int ret;
-	struct hxi_device *hxi = dev_get_drvdata(dev);
+	struct hxi_reader *reader = file->private_data;
+	struct hxi_ring *ring = reader->ring;
+	__poll_t mask = 0;
 
-	switch (type) {
-	case hwmon_in:
-	case hwmon_curr:
-	case hwmon_power:
-		switch (attr) {
-		case hwmon_in_label: /* this includes current as well */
-		case hwmon_power_label:
-			*str = hxi->rails[channel].label;
-			ret = 0;
-			break;
-		default:
-			ret = -EOPNOTSUPP;
-			break;
-		}
-		break;
-	default:
-		ret = -EOPNOTSUPP;
-		break;
-	}
+	poll_wait(file, &ring->wait, wait);
 
-	return ret;
+	mutex_lock(&ring->lock);
+	if (reader->pos != ring->head)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&ring->lock);
+
+	if (READ_ONCE(ring->dead))
+		mask |= EPOLLHUP | EPOLLERR;
+
+	return mask;
 }
 
-static int hxi_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int chan, long *val)
+static const struct file_operations hxi_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = hxi_ring_open,
+	.release = hxi_ring_release,
+	.read = hxi_ring_read,
+	.llseek = hxi_ring_llseek,
+	.mmap = hxi_ring_mmap,
+	.poll = hxi_ring_poll,
+};
+
+static int hxi_ring_create(struct hxi_device *hxi)
 {
-	struct hxi_device *hxi = dev_get_drvdata(dev);
-	int ret = -EOPNOTSUPP;
-	int data;
+	struct hxi_ring *ring;
+	int ret;
 
-	switch (type) {
-	case hwmon_temp:
-		switch (attr) {
-		case hwmon_temp_input:
-			data = get_temperature(hxi, chan);
-			if (data < 0) {
-				ret = -ENODATA;
-				goto exit;
-			}
-			*val = data;
-			ret = 0;
-			break;
-		default:
-			break;
-		}
-		break;
-	case hwmon_in:
-		switch (attr) {
-		case hwmon_in_input:
-			data = get_data(hxi, hxi->rails[chan].sensor, hxi->rails[chan].volt_cmd);
-			if (data < 0) {
-				ret = -ENODATA;
-				goto exit;
-			}
-			*val = data;
-			ret = 0;
-			break;
-		default:
-			break;
-		}
-		break;
-	case hwmon_curr:
-		switch (attr) {
-		case hwmon_curr_input:
-			data = get_data(hxi, hxi->rails[chan].sensor, hxi->rails[chan].amp_cmd);
-			if (data < 0) {
-				ret = -ENODATA;
-				goto exit;
-			}
-			*val = data;
-			ret = 0;
-			break;
-		default:
-			break;
-		}
-		break;
-	case hwmon_power:
-		switch (attr) {
-		case hwmon_power_input:
-			data = get_data(hxi, hxi->rails[chan].sensor, hxi->rails[chan].power_cmd);
-			if (data < 0) {
-				ret = -ENODATA;
-				goto exit;
-			}
-			/*power is reported in uW, more scaling needed */
-			*val = data * 1000;
-			ret = 0;
-			break;
-		default:
-			break;
-		}
-		break;
-	default:
-		break;
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->header = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(RING_RECORDS * sizeof(struct hxi_record)));
+	if (!ring->header) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
+	ring->header->version = HXI_RING_VERSION;
+	ring->header->record_size = sizeof(struct hxi_record);
+	ring->header->records = RING_RECORDS;
+	ring->header->data_offset = PAGE_SIZE;
+	ring->records = (void *)ring->header + PAGE_SIZE;
 
-exit:
+	ring->id = ida_alloc(&hxi_ida, GFP_KERNEL);
+	if (ring->id < 0) {
+		ret = ring->id;
+		goto out_free;
+	}
+
+	kref_init(&ring->kref);
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+	scnprintf(ring->name, sizeof(ring->name), "hxipsu%d", ring->id);
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.fops = &hxi_ring_fops;
+	ring->misc.parent = &hxi->hdev->dev;
+	ring->misc.mode = 0444;
+
+	ret = misc_register(&ring->misc);
+	if (ret)
+		goto out_ida;
+
+	hxi->ring = ring;
+	return 0;
+
+out_ida:
+	ida_free(&hxi_ida, ring->id);
+out_free:
+	vfree(ring->header);
+	kfree(ring);
 	return ret;
 }
 
-static int hxi_write(struct device *dev, enum hwmon_sensor_types type,
-		     u32 attr, int channel, long val)
+static void hxi_ring_destroy(struct hxi_device *hxi)
 {
-	return -EOPNOTSUPP;
-}
+	struct hxi_ring *ring = hxi->ring;
 
-static umode_t hxi_is_visible(const void *data, enum hwmon_sensor_types type, u32 attr, int channel)
-{
-	return 0444;
+	misc_deregister(&ring->misc);
+	ida_free(&hxi_ida, ring->id);
+	WRITE_ONCE(ring->dead, true);
+	wake_up_interruptible_all(&ring->wait);
+	kref_put(&ring->kref, hxi_ring_free);
 }
 
-static const struct hwmon_ops hxi_hwmon_ops = {
-	.is_visible = hxi_is_visible,
-	.read = hxi_read,
-	.read_string = hxi_read_string,
-	.write = hxi_write,
-};
-
-static const struct hwmon_channel_info *hxi_info[] = {
-	HWMON_CHANNEL_INFO(chip, HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp,
-			   HWMON_T_INPUT,
-			   HWMON_T_INPUT
-	),
-	HWMON_CHANNEL_INFO(in,
-			   HWMON_I_INPUT | HWMON_I_LABEL,
-			   HWMON_I_INPUT | HWMON_I_LABEL,
-			   HWMON_I_INPUT | HWMON_I_LABEL,
-			   HWMON_I_INPUT | HWMON_I_LABEL
-	),
-	HWMON_CHANNEL_INFO(curr,
-			   HWMON_C_INPUT | HWMON_C_LABEL,
-			   HWMON_C_INPUT | HWMON_C_LABEL,
-			   HWMON_C_INPUT | HWMON_C_LABEL
-	),
-	HWMON_CHANNEL_INFO(power,
-			   HWMON_P_INPUT | HWMON_P_LABEL,
-			   HWMON_P_INPUT | HWMON_P_LABEL,
-			   HWMON_P_INPUT | HWMON_P_LABEL,
-			   HWMON_P_INPUT | HWMON_P_LABEL
-	),
-	NULL
-};
-
-static const struct hwmon_chip_info hxi_chip_info = {
-	.ops = &hxi_hwmon_ops,
-	.info = hxi_info,
-};
-
 static int hxi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
+	struct hxi_request req;
 	struct hxi_device *hxi;
 	int ret;
 	int i;
@@ -397,8 +2431,8 @@ static int hxi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto exit;
 	}
 
-	hxi->buffer = devm_kmalloc(&hdev->dev, OUT_BUFFER_SIZE, GFP_KERNEL);
-	if (!hxi->buffer) {
+	hxi->tx_buffer = devm_kmalloc(&hdev->dev, OUT_BUFFER_SIZE, GFP_KERNEL);
+	if (!hxi->tx_buffer) {
 		ret = -ENOMEM;
 		goto exit;
 	}
@@ -413,6 +2447,7 @@ static int hxi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	hxi->rails[1].sensor = SENSOR_5V;
 	hxi->rails[2].sensor = SENSOR_3V;
 	hxi->rails[3].sensor = UNSWITCHED;
+	hxi->page = SENSOR_UNKNOWN;
 	hxi->rails[3].volt_cmd = SIG_WALL_VOLTS;
 	hxi->rails[3].power_cmd = SIG_TOTAL_WATTS;
 
@@ -436,32 +2471,83 @@ static int hxi_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	hxi->hdev = hdev;
 	hid_set_drvdata(hdev, hxi);
 	mutex_init(&hxi->mutex);
-	init_completion(&hxi->wait_input_report);
+	spin_lock_init(&hxi->lock);
+	hxi->timeout_us = REQ_TIMEOUT * USEC_PER_MSEC;
+	INIT_LIST_HEAD(&hxi->queue);
+	INIT_DELAYED_WORK(&hxi->tx_work, hxi_tx_work);
+	timer_setup(&hxi->timeout, hxi_timeout, 0);
+	seqlock_init(&hxi->sample_seq);
+	init_waitqueue_head(&hxi->refresh_wait);
 
-	hid_device_io_start(hdev);
+	hxi->update_interval = clamp_val(sample_interval, MIN_SAMPLE_INTERVAL,
+					 MAX_SAMPLE_INTERVAL);
+	INIT_DELAYED_WORK(&hxi->sample_work, hxi_sample_work);
 
-	hxi->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "hxipsu",
-							 hxi, &hxi_chip_info, 0);
-	if (IS_ERR(hxi->hwmon_dev)) {
-		ret = (int)PTR_ERR(hxi->hwmon_dev);
-		goto out_hw_close;
+	/* a gentle default curve on temp1, the intake */
+	mutex_init(&hxi->fan_lock);
+	for (i = 0; i < CURVE_POINTS; i++) {
+		hxi->curve.temp[i] = 30000 + i * 10000;
+		hxi->curve.pwm[i] = 64 + i * 191 / (CURVE_POINTS - 1);
 	}
+	hxi->curve.channels = BIT(0);
+
+	hid_device_io_start(hdev);
 
 	/*
 	 * This needs to be sent at least once per PSU power cycle or other commands won't work.
 	 */
+	hxi_cmd(&req, SIG_POORLY_UNDERSTOOD_INIT, 0x3, 0x0);
 	mutex_lock(&hxi->mutex);
-	ret = send_usb_cmd(hxi, SIG_POORLY_UNDERSTOOD_INIT, 0x3, 0x0);
-	if (ret)
-		ret = -ENODATA;
-	else
-		ret = (hxi->buffer[2] << 8) + hxi->buffer[3];
+	send_usb_cmds(hxi, &req, 1);
 	mutex_unlock(&hxi->mutex);
 
+	hxi_read_ident(hxi);
+
+	/* sweep once up front so the first sysfs read already has data */
+	hxi_sweep(hxi);
+	hxi_read_ocp_limits(hxi);
+
+	/*
+	 * Everything the sampler touches has to exist before hwmon is
+	 * registered, a write to update_interval already queues a sweep.
+	 */
+	hxi->counters = kzalloc(sizeof(*hxi->counters), GFP_KERNEL);
+	if (!hxi->counters) {
+		ret = -ENOMEM;
+		goto out_hw_close;
+	}
+	kref_init(&hxi->counters->kref);
+
+	ret = hxi_ring_create(hxi);
+	if (ret)
+		goto out_counters_put;
+
+	/*
+	 * IIO, perf and powercap are optional, failing to register them only
+	 * warns. perf and powercap are named like the ring device, e.g. hxipsu0.
+	 */
+	hxi_iio_register(hxi);
+
+	hxi->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "hxipsu",
+							 hxi, &hxi_chip_info, hxi_groups);
+	if (IS_ERR(hxi->hwmon_dev)) {
+		ret = (int)PTR_ERR(hxi->hwmon_dev);
+		goto out_ring_destroy;
+	}
+
+	schedule_delayed_work(&hxi->sample_work, msecs_to_jiffies(hxi->update_interval));
+	hxi_pmu_register(hxi);
+	hxi_powercap_register(hxi);
+	hxi_debugfs_init(hxi);
 
 	ret = 0;
 	goto exit;
 
+out_ring_destroy:
+	hxi_iio_unregister(hxi);
+	hxi_ring_destroy(hxi);
+out_counters_put:
+	kref_put(&hxi->counters->kref, hxi_counters_free);
 out_hw_close:
 	hid_hw_close(hdev);
 out_hw_stop:
@@ -474,7 +2560,21 @@ static void hxi_remove(struct hid_device *hdev)
 {
 	struct hxi_device *hxi = hid_get_drvdata(hdev);
 
+	debugfs_remove_recursive(hxi->debugfs);
+	hxi_powercap_unregister(hxi);
+	hxi_pmu_unregister(hxi);
+	/* no more update_interval writes that could requeue the sampler */
 	hwmon_device_unregister(hxi->hwmon_dev);
+	cancel_delayed_work_sync(&hxi->sample_work);
+	/* the sampler pushes to both, so they go only now that it is stopped */
+	hxi_iio_unregister(hxi);
+	hxi_ring_destroy(hxi);
+	kref_put(&hxi->counters->kref, hxi_counters_free);
+	/* nobody is left to follow the curve, give the fan back to the PSU */
+	if (hxi->fan_curve)
+		hxi_write_byte(hxi, SIG_FAN_MODE, FAN_MODE_HARDWARE);
+	timer_delete_sync(&hxi->timeout);
+	cancel_delayed_work_sync(&hxi->tx_work);
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
 }
@@ -488,7 +2588,7 @@ static const struct hid_device_id hxi_devices[] = {
 };
 
 static struct hid_driver hxi_driver = {
-	.name = "corsair-hxi",
+	.name = DRIVER_NAME,
 	.id_table = hxi_devices,
 	.probe = hxi_probe,
 	.remove = hxi_remove,
@@ -499,12 +2599,21 @@ MODULE_DEVICE_TABLE(hid, hxi_devices);
 
 static int __init hxi_init(void)
 {
-	return hid_register_driver(&hxi_driver);
+	int ret;
+
+	hxi_pmu_init();
+	ret = hid_register_driver(&hxi_driver);
+	if (ret)
+		hxi_pmu_exit();
+
+	return ret;
 }
 
 static void __exit hxi_exit(void)
 {
 	hid_unregister_driver(&hxi_driver);
+	hxi_pmu_exit();
+	ida_destroy(&hxi_ida);
 }
 
 /*
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * corsair-hxi-psu.h - sample records of the hxipsu character devices
+ *
+ * Every background sweep of the driver appends one record to a ring that is
+ * read from /dev/hxipsu<N>. This header is meant to be included by userspace
+ * consumers as well.
+ *
+ * Instead of read(), the ring can be mmap()ed read-only: a page holding
+ * struct hxi_ring_header, followed by the records at data_offset. The record
+ * with sequence number n is at index n & (records - 1). To read it without
+ * racing the driver:
+ *
+ *	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+ *	if (n >= head)
+ *		wait, n has not been written yet
+ *	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n)
+ *		n has been overwritten, or is being overwritten right now
+ *	copy *slot
+ *	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != n)
+ *		n was overwritten while copying, discard the copy
+ *
+ * poll() reports the file readable until its position, the seq of the next
+ * record read() would return, reaches head. A consumer of the mapping moves
+ * it past the records it has seen with lseek(fd, n + 1, SEEK_SET).
+ */
+
+#ifndef _CORSAIR_HXI_PSU_H
+#define _CORSAIR_HXI_PSU_H
+
+#include <linux/types.h>
+
+#define HXI_RING_VERSION	1
+
+/* hxi_record.seq of a slot the driver is writing to */
+#define HXI_RECORD_BUSY		(~0ULL)
+
+/* bits of hxi_record.valid, set if the field holds a value of this sweep */
+#define HXI_VALID_TEMP(i)	(1U << (i))
+#define HXI_VALID_IN(i)		(1U << (2 + (i)))
+#define HXI_VALID_CURR(i)	(1U << (6 + (i)))
+#define HXI_VALID_POWER(i)	(1U << (9 + (i)))
+
+/*
+ * One sweep, in the units and channel order of the hwmon attributes: index 3
+ * of in and power is the wall, curr has no wall channel.
+ */
+struct hxi_record {
+	__u64 seq;		/* number of records written before this one */
+	__u64 time_ns;		/* CLOCK_MONOTONIC at the end of the sweep */
+	__s32 temp[2];		/* millidegree Celsius */
+	__s32 in[4];		/* millivolt */
+	__s32 curr[3];		/* milliampere */
+	__s32 power[4];		/* microwatt */
+	__u32 valid;		/* HXI_VALID_* */
+};
+
+struct hxi_ring_header {
+	__u32 version;		/* HXI_RING_VERSION */
+	__u32 record_size;	/* sizeof(struct hxi_record) */
+	__u32 records;		/* slots in the ring, a power of two */
+	__u32 data_offset;	/* of the first slot from the start of the mapping */
+	__u64 head;		/* records written so far, the newest is head - 1 */
+};
+
+#endif /* _CORSAIR_HXI_PSU_H */
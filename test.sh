@@ -1 +1 @@
-make && sudo rmmod corsair_hxi_psu ; sudo insmod ./corsair-hxi-psu.ko && sensors hxipsu-*
+make && sudo rmmod corsair_hxi_psu ; sudo modprobe -a industrialio industrialio-kfifo-buf 2>/dev/null ; sudo insmod ./corsair-hxi-psu.ko && sensors hxipsu-*
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Benchmarks sysfs reads of the driver against the uhid simulator.
+# THREADS, DURATION and SIM_ARGS can be set in the environment.
+cd "$(dirname "$0")/.." || exit 1
+
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-10}
+SIM_ARGS=${SIM_ARGS:--l 2 -j 1}
+
+sudo modprobe uhid || exit 1
+# insmod doesn't load dependencies, the module needs these if IIO is modular
+sudo modprobe -a industrialio industrialio-kfifo-buf 2>/dev/null
+sudo rmmod corsair_hxi_psu 2>/dev/null
+sudo insmod ./corsair-hxi-psu.ko || exit 1
+
+sudo ./tools/hxi-sim $SIM_ARGS &
+SIM=$!
+trap 'sudo kill $SIM 2>/dev/null' EXIT
+
+# wait for the driver to bind to the simulator and register its hwmon device
+for i in $(seq 50); do
+	for hwmon in /sys/class/hwmon/hwmon*; do
+		grep -qs "HID_NAME=Corsair HXi PSU simulator" "$hwmon/device/uevent" || continue
+		dev=$(basename "$(readlink -f "$hwmon/device")")
+		sudo ./tools/hxi-bench -d "$hwmon" -t "$THREADS" -T "$DURATION" \
+			-D "/sys/kernel/debug/corsair-hxi-$dev"
+		exit $?
+	done
+	sleep 0.1
+done
+
+echo "simulated PSU did not show up" >&2
+exit 1
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * hxi-bench.c - sysfs read latency benchmark for corsair-hxi-psu
+ *
+ * Reads every in*, curr*, power* and temp* input of an hxipsu hwmon device
+ * from several threads for a fixed time, the way monitoring agents do:
+ * open, read, close. Reports throughput, latency percentiles and, when the
+ * driver's debugfs directory is given, USB transactions per read.
+ *
+ * Run it against tools/hxi-sim for reproducible numbers, see tools/bench.sh.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ATTRS 64
+
+struct worker {
+	pthread_t thread;
+	int first; /* attribute to start with, spreads threads over the files */
+	uint32_t *latency_ns;
+	size_t nr, size;
+	unsigned long errors;
+};
+
+static char *attrs[MAX_ATTRS];
+static int nr_attrs;
+static volatile bool stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool wanted(const char *name)
+{
+	static const char * const prefixes[] = { "in", "curr", "power", "temp" };
+	const char *suffix = strrchr(name, '_');
+	size_t i;
+
+	if (!suffix || strcmp(suffix, "_input"))
+		return false;
+
+	for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		if (!strncmp(name, prefixes[i], strlen(prefixes[i])))
+			return true;
+	}
+	return false;
+}
+
+static int find_attrs(const char *dir)
+{
+	struct dirent *ent;
+	DIR *d = opendir(dir);
+
+	if (!d) {
+		perror(dir);
+		return -1;
+	}
+
+	while ((ent = readdir(d)) && nr_attrs < MAX_ATTRS) {
+		if (!wanted(ent->d_name))
+			continue;
+		if (asprintf(&attrs[nr_attrs], "%s/%s", dir, ent->d_name) < 0)
+			break;
+		nr_attrs++;
+	}
+	closedir(d);
+
+	return nr_attrs ? 0 : -1;
+}
+
+static void record(struct worker *w, uint64_t ns)
+{
+	uint32_t *grown;
+
+	if (w->nr == w->size) {
+		w->size = w->size ? 2 * w->size : 65536;
+		grown = realloc(w->latency_ns, w->size * sizeof(*grown));
+		if (!grown) {
+			stop = true;
+			return;
+		}
+		w->latency_ns = grown;
+	}
+	w->latency_ns[w->nr++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	char buf[32];
+	uint64_t start;
+	ssize_t len;
+	int i = w->first;
+	int fd;
+
+	while (!stop) {
+		start = now_ns();
+		fd = open(attrs[i], O_RDONLY);
+		len = fd < 0 ? -1 : read(fd, buf, sizeof(buf));
+		if (fd >= 0)
+			close(fd);
+		record(w, now_ns() - start);
+		if (len <= 0)
+			w->errors++;
+		i = (i + 1) % nr_attrs;
+	}
+
+	return NULL;
+}
+
+static long read_counter(const char *dir, const char *name)
+{
+	char path[512];
+	long value = -1;
+	FILE *f;
+
+	if (!dir)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &value) != 1)
+		value = -1;
+	fclose(f);
+
+	return value;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint32_t *sorted, size_t nr, double p)
+{
+	size_t i = p * (nr - 1);
+
+	return sorted[i] / 1000.0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s -d hwmon_dir [-t threads] [-T seconds] [-D debugfs_dir]\n"
+		"  -d  hwmon device directory, e.g. /sys/class/hwmon/hwmon3\n"
+		"  -t  number of concurrent reader threads (default 4)\n"
+		"  -T  duration in seconds (default 10)\n"
+		"  -D  driver debugfs directory, to report USB transactions per read\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *hwmon = NULL, *debugfs = NULL;
+	unsigned long errors = 0;
+	long tx_before, tx_after;
+	struct worker *workers;
+	unsigned int seconds = 10;
+	int threads = 4;
+	uint64_t start, elapsed;
+	uint32_t *all;
+	size_t nr = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:t:T:D:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			hwmon = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'T':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			debugfs = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!hwmon || threads < 1 || !seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (find_attrs(hwmon)) {
+		fprintf(stderr, "no sensor inputs found in %s\n", hwmon);
+		return 1;
+	}
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	tx_before = read_counter(debugfs, "transactions");
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		workers[i].first = i % nr_attrs;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	sleep(seconds);
+	stop = true;
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		nr += workers[i].nr;
+		errors += workers[i].errors;
+	}
+	elapsed = now_ns() - start;
+	tx_after = read_counter(debugfs, "transactions");
+
+	all = malloc((nr ? nr : 1) * sizeof(*all));
+	if (!all)
+		return 1;
+	nr = 0;
+	for (i = 0; i < threads; i++) {
+		memcpy(all + nr, workers[i].latency_ns, workers[i].nr * sizeof(*all));
+		nr += workers[i].nr;
+	}
+	if (!nr) {
+		fprintf(stderr, "no reads completed\n");
+		return 1;
+	}
+	qsort(all, nr, sizeof(*all), cmp_u32);
+
+	printf("attributes:   %d\n", nr_attrs);
+	printf("threads:      %d\n", threads);
+	printf("duration:     %.1f s\n", elapsed / 1e9);
+	printf("reads:        %zu (%.0f/s), %lu failed\n", nr, nr / (elapsed / 1e9), errors);
+	printf("latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	       percentile(all, nr, 0.5), percentile(all, nr, 0.99),
+	       percentile(all, nr, 0.999), all[nr - 1] / 1000.0);
+	if (tx_before >= 0 && tx_after >= 0)
+		printf("usb requests: %ld (%.4f per read)\n", tx_after - tx_before,
+		       (double)(tx_after - tx_before) / nr);
+	else
+		printf("usb requests: unknown, pass -D with the driver's debugfs directory\n");
+
+	return 0;
+}
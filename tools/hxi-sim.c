@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * hxi-sim.c - simulated Corsair HXi PSU for corsair-hxi-psu
+ *
+ * Registers a fake HXi with the kernel through /dev/uhid, so the driver binds
+ * to it exactly like to the real USB device. It answers the commands the
+ * driver uses:
+ *      * 0xfe init
+ *      * 0x02 write, register 0x00 selects the 12V/5V/3.3V page, 0x3B sets the
+ *        fan duty in percent, 0xF0 the fan mode (0 hardware, 1 software) and
+ *        0xD8 the OCP mode (1 single rail, 2 multi rail)
+ *      * 0x03 read, with PMBus linear11 encoded measurements, identification
+ *        strings and uptime counters
+ * Replies can be delayed by a fixed latency plus random jitter, and dropped
+ * at a given rate, to exercise timeouts and retries without hardware.
+ *
+ * Needs the uhid module and write access to /dev/uhid, usually root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#define USB_VENDOR_ID_CORSAIR 0x1b1c
+#define REPORT_SIZE 64
+#define NUM_PAGES 3
+
+/* same registers as enum hxi_sensor_cmd in the driver */
+#define REG_PAGE 0x00
+#define REG_WALL_VOLTS 0x88
+#define REG_VOLTS 0x8B
+#define REG_AMPS 0x8C
+#define REG_TEMPERATURE_1 0x8D
+#define REG_TEMPERATURE_2 0x8E
+#define REG_WATTS 0x96
+#define REG_TOTAL_WATTS 0xEE
+#define REG_FAN 0x90
+#define REG_FAN_DUTY 0x3B
+#define REG_FAN_MODE 0xF0
+#define REG_OCP_LIMIT 0x46
+#define REG_OCP_MODE 0xD8
+#define REG_VENDOR 0x99
+#define REG_PRODUCT 0x9A
+#define REG_REVISION 0x9B
+#define REG_TOTAL_UPTIME 0xD1
+#define REG_UPTIME 0xD2
+
+/* longest string reply, after command and register */
+#define MAX_STR 22
+
+#define OCP_MODE_SINGLE 1
+#define OCP_MODE_MULTI 2
+
+#define FAN_MAX_RPM 2000
+
+#define CMD_WRITE 0x02
+#define CMD_READ 0x03
+#define CMD_INIT 0xfe
+
+/* vendor defined, 64 byte input and output reports without report ids */
+static const uint8_t report_descriptor[] = {
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,		/* Usage (0x01) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, REPORT_SIZE,	/*   Report Count (64) */
+	0x09, 0x02,		/*   Usage (0x02) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0x95, REPORT_SIZE,	/*   Report Count (64) */
+	0x09, 0x03,		/*   Usage (0x03) */
+	0x91, 0x02,		/*   Output (Data,Var,Abs) */
+	0xc0,			/* End Collection */
+};
+
+static const struct {
+	unsigned int watts;
+	uint16_t product;
+} models[] = {
+	{ 750, 0x1c05 },
+	{ 850, 0x1c06 },
+	{ 1000, 0x1c07 },
+	{ 1200, 0x1c08 },
+};
+
+struct rail {
+	double volts;
+	double amps;
+	double ocp_amps;
+};
+
+struct sim {
+	int fd;
+	unsigned int latency_us;
+	unsigned int jitter_us;
+	double drop_rate;
+	bool verbose;
+	int page;
+	struct rail rails[NUM_PAGES];
+	double wall_volts;
+	double efficiency;
+	double temp[2];
+	uint8_t fan_mode;
+	uint8_t fan_duty;
+	uint8_t ocp_mode;
+	double ocp_single_amps; /* of the 12V rail in single rail mode */
+	char product[MAX_STR];
+	time_t started;
+	unsigned long requests;
+	unsigned long dropped;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+/* PMBus linear11: 5 bit signed exponent, 11 bit signed mantissa */
+static uint16_t encode_linear11(double value)
+{
+	long mantissa;
+	int exponent;
+
+	for (exponent = -16; exponent < 15; exponent++) {
+		mantissa = lround(ldexp(value, -exponent));
+		if (mantissa >= -1024 && mantissa <= 1023)
+			break;
+	}
+	mantissa = lround(ldexp(value, -exponent));
+
+	return ((exponent & 0x1f) << 11) | (mantissa & 0x7ff);
+}
+
+/* +/- 1% of noise so consecutive reads are distinguishable */
+static double noisy(double value)
+{
+	return value * (1.0 + (drand48() - 0.5) / 50.0);
+}
+
+static double rail_watts(const struct rail *rail)
+{
+	return rail->volts * rail->amps;
+}
+
+static double total_watts(const struct sim *sim)
+{
+	double watts = 0;
+	int i;
+
+	for (i = 0; i < NUM_PAGES; i++)
+		watts += rail_watts(&sim->rails[i]);
+
+	return watts / sim->efficiency;
+}
+
+/* in hardware mode the fan follows the temperature, from 40 to 60 degrees */
+static double fan_rpm(const struct sim *sim)
+{
+	double duty = sim->fan_duty;
+
+	if (!sim->fan_mode)
+		duty = fmin(fmax((sim->temp[0] - 40) * 5, 0), 100);
+
+	return FAN_MAX_RPM * duty / 100;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0) {
+		perror("write /dev/uhid");
+		return -errno;
+	}
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+static int create(struct sim *sim, uint16_t product)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "Corsair HXi PSU simulator");
+	memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+	ev.u.create2.rd_size = sizeof(report_descriptor);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = USB_VENDOR_ID_CORSAIR;
+	ev.u.create2.product = product;
+
+	return uhid_write(sim->fd, &ev);
+}
+
+static void destroy(struct sim *sim)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(sim->fd, &ev);
+}
+
+static void put_le16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = value >> 8;
+}
+
+static void put_le32(uint8_t *buf, uint32_t value)
+{
+	put_le16(buf, value & 0xffff);
+	put_le16(buf + 2, value >> 16);
+}
+
+/* NUL padded, not terminated if it fills the reply */
+static void put_str(uint8_t *buf, const char *str)
+{
+	strncpy((char *)buf, str, MAX_STR);
+}
+
+/* fills in the reply to a read, returns false for unknown registers */
+static bool read_register(struct sim *sim, uint8_t reg, uint8_t *data)
+{
+	const struct rail *rail = &sim->rails[sim->page];
+	int millicelsius;
+
+	switch (reg) {
+	case REG_VOLTS:
+		put_le16(data, encode_linear11(noisy(rail->volts)));
+		return true;
+	case REG_AMPS:
+		put_le16(data, encode_linear11(noisy(rail->amps)));
+		return true;
+	case REG_WATTS:
+		put_le16(data, encode_linear11(noisy(rail_watts(rail))));
+		return true;
+	case REG_WALL_VOLTS:
+		put_le16(data, encode_linear11(noisy(sim->wall_volts)));
+		return true;
+	case REG_TOTAL_WATTS:
+		put_le16(data, encode_linear11(noisy(total_watts(sim))));
+		return true;
+	case REG_TEMPERATURE_1:
+	case REG_TEMPERATURE_2:
+		/* big endian millidegrees, the way get_temperature() decodes them */
+		millicelsius = noisy(sim->temp[reg - REG_TEMPERATURE_1]) * 1000;
+		data[0] = millicelsius >> 8;
+		data[1] = millicelsius & 0xff;
+		return true;
+	case REG_FAN:
+		put_le16(data, encode_linear11(noisy(fan_rpm(sim))));
+		return true;
+	case REG_FAN_DUTY:
+		data[0] = sim->fan_duty;
+		return true;
+	case REG_FAN_MODE:
+		data[0] = sim->fan_mode;
+		return true;
+	case REG_OCP_MODE:
+		data[0] = sim->ocp_mode;
+		return true;
+	case REG_VENDOR:
+		put_str(data, "CORSAIR");
+		return true;
+	case REG_PRODUCT:
+		put_str(data, sim->product);
+		return true;
+	case REG_REVISION:
+		put_str(data, "sim");
+		return true;
+	case REG_UPTIME:
+		put_le32(data, time(NULL) - sim->started);
+		return true;
+	case REG_TOTAL_UPTIME:
+		/* as if it had been running for a year before */
+		put_le32(data, time(NULL) - sim->started + 365 * 24 * 3600);
+		return true;
+	case REG_OCP_LIMIT:
+		if (sim->page == 0 && sim->ocp_mode == OCP_MODE_SINGLE)
+			put_le16(data, encode_linear11(sim->ocp_single_amps));
+		else
+			put_le16(data, encode_linear11(rail->ocp_amps));
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void handle_output(struct sim *sim, const uint8_t *data, size_t size)
+{
+	struct uhid_event ev;
+	uint8_t *reply = ev.u.input2.data;
+	unsigned int delay;
+
+	if (size < 3)
+		return;
+
+	sim->requests++;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = REPORT_SIZE;
+	/* every reply starts with an echo of command and register */
+	reply[0] = data[0];
+	reply[1] = data[1];
+
+	switch (data[0]) {
+	case CMD_INIT:
+		break;
+	case CMD_WRITE:
+		if (data[1] == REG_PAGE && data[2] < NUM_PAGES)
+			sim->page = data[2];
+		else if (data[1] == REG_FAN_DUTY && data[2] <= 100)
+			sim->fan_duty = data[2];
+		else if (data[1] == REG_FAN_MODE && data[2] <= 1)
+			sim->fan_mode = data[2];
+		else if (data[1] == REG_OCP_MODE &&
+			 (data[2] == OCP_MODE_SINGLE || data[2] == OCP_MODE_MULTI))
+			sim->ocp_mode = data[2];
+		reply[2] = data[2];
+		break;
+	case CMD_READ:
+		/* unsupported commands are answered with a zero command byte */
+		if (!read_register(sim, data[1], &reply[2]))
+			reply[0] = 0;
+		break;
+	default:
+		reply[0] = 0;
+		break;
+	}
+
+	if (sim->verbose)
+		fprintf(stderr, "%02x %02x %02x -> %02x %02x %02x %02x (page %d)\n",
+			data[0], data[1], data[2], reply[0], reply[1], reply[2], reply[3],
+			sim->page);
+
+	if (drand48() < sim->drop_rate) {
+		sim->dropped++;
+		return;
+	}
+
+	delay = sim->latency_us;
+	if (sim->jitter_us)
+		delay += lrand48() % sim->jitter_us;
+	if (delay)
+		usleep(delay);
+
+	uhid_write(sim->fd, &ev);
+}
+
+static int handle_event(struct sim *sim)
+{
+	struct uhid_event ev, answer;
+	ssize_t ret;
+
+	ret = read(sim->fd, &ev, sizeof(ev));
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	memset(&answer, 0, sizeof(answer));
+	switch (ev.type) {
+	case UHID_OUTPUT:
+		handle_output(sim, ev.u.output.data, ev.u.output.size);
+		break;
+	case UHID_GET_REPORT:
+		answer.type = UHID_GET_REPORT_REPLY;
+		answer.u.get_report_reply.id = ev.u.get_report.id;
+		answer.u.get_report_reply.err = EIO;
+		return uhid_write(sim->fd, &answer);
+	case UHID_SET_REPORT:
+		answer.type = UHID_SET_REPORT_REPLY;
+		answer.u.set_report_reply.id = ev.u.set_report.id;
+		answer.u.set_report_reply.err = EIO;
+		return uhid_write(sim->fd, &answer);
+	case UHID_START:
+	case UHID_STOP:
+	case UHID_OPEN:
+	case UHID_CLOSE:
+		if (sim->verbose)
+			fprintf(stderr, "uhid event %u\n", ev.type);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-m watts] [-l latency_ms] [-j jitter_ms] [-d drop_rate] [-s seed] [-v]\n"
+		"  -m  model to simulate: 750, 850, 1000 or 1200 (default 850)\n"
+		"  -l  fixed reply latency in ms, fractions allowed (default 2)\n"
+		"  -j  additional uniformly distributed reply latency in ms (default 0)\n"
+		"  -d  fraction of requests that get no reply, 0 to 1 (default 0)\n"
+		"  -s  random seed, for reproducible runs (default 1)\n"
+		"  -v  log every request\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct sim sim = {
+		.latency_us = 2000,
+		.rails = {
+			{ 12.1, 20.0, 40.0 },
+			{ 5.0, 3.0, 25.0 },
+			{ 3.3, 2.0, 25.0 },
+		},
+		.wall_volts = 230.0,
+		.efficiency = 0.92,
+		.temp = { 35.0, 40.0 },
+		.fan_duty = 40,
+		.ocp_mode = OCP_MODE_MULTI,
+	};
+	unsigned int watts = 850;
+	long seed = 1;
+	uint16_t product = 0;
+	int opt;
+	int ret;
+	int i;
+
+	while ((opt = getopt(argc, argv, "m:l:j:d:s:vh")) != -1) {
+		switch (opt) {
+		case 'm':
+			watts = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			sim.latency_us = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			sim.jitter_us = strtod(optarg, NULL) * 1000;
+			break;
+		case 'd':
+			sim.drop_rate = strtod(optarg, NULL);
+			break;
+		case 's':
+			seed = strtol(optarg, NULL, 0);
+			break;
+		case 'v':
+			sim.verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+		if (models[i].watts == watts)
+			product = models[i].product;
+	}
+	if (!product) {
+		fprintf(stderr, "unknown model %u\n", watts);
+		return 1;
+	}
+	/* in single rail mode the 12V rail may deliver the full rating */
+	sim.ocp_single_amps = watts / 12.0;
+	snprintf(sim.product, sizeof(sim.product), "HX%ui", watts);
+	sim.started = time(NULL);
+	srand48(seed);
+
+	sim.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (sim.fd < 0) {
+		perror("open /dev/uhid");
+		return 1;
+	}
+
+	ret = create(&sim, product);
+	if (ret) {
+		close(sim.fd);
+		return 1;
+	}
+	fprintf(stderr, "simulating HX%ui, latency %u us, jitter %u us, drop rate %g\n",
+		watts, sim.latency_us, sim.jitter_us, sim.drop_rate);
+
+	/* no SA_RESTART, so a signal interrupts the blocking read below */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop) {
+		ret = handle_event(&sim);
+		if (ret) {
+			fprintf(stderr, "reading /dev/uhid failed: %s\n", strerror(-ret));
+			break;
+		}
+	}
+
+	destroy(&sim);
+	close(sim.fd);
+	fprintf(stderr, "%lu requests, %lu dropped\n", sim.requests, sim.dropped);
+
+	return ret ? 1 : 0;
+}
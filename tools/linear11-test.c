@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * linear11-test.c - checks the linear11 decoding of corsair-hxi-psu
+ *
+ * Builds decode_corsair_float() from corsair-hxi-linear11.h, exactly as the
+ * driver does, and compares it with the original branchy implementation for
+ * every possible input. Then times both over all inputs.
+ *
+ * Exits with 1 if any input decodes differently.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* what the header expects from the kernel */
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+
+static inline s32 sign_extend32(u32 value, int index)
+{
+	u8 shift = 31 - index;
+
+	return (s32)(value << shift) >> shift;
+}
+
+#include "../corsair-hxi-linear11.h"
+
+#define ROUNDS 1000
+
+/* keeps the timed loops from being optimized away */
+static volatile int sink;
+
+/*
+ * The driver before the scale table. The kernel is built with
+ * -fno-strict-overflow, so int arithmetic wraps there; the casts to unsigned
+ * give the same results without relying on that here.
+ */
+static int decode_reference(u16 input)
+{
+	int ret;
+	int exponent = input >> 11;
+	int fraction = input & 2047;
+
+	if (exponent > 15)
+		exponent = -(32 - exponent);
+	if (fraction > 1023)
+		fraction = -(2048 - fraction);
+	if (fraction & 1)
+		fraction++;
+	/* scale to milli-units */
+	fraction = (int)((unsigned int)fraction * 1000);
+	if (exponent < 0)
+		ret = fraction >> ((~exponent) + 1);
+	else
+		ret = (int)((unsigned int)fraction << exponent);
+	return ret;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ns per decode over ROUNDS passes through all inputs */
+static double time_decode(int (*decode)(u16 input))
+{
+	uint64_t start;
+	int round;
+	unsigned int sum = 0;
+	u32 i;
+
+	start = now_ns();
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < 65536; i++)
+			sum += decode(i);
+	}
+	sink = sum;
+
+	return (double)(now_ns() - start) / ROUNDS / 65536;
+}
+
+int main(void)
+{
+	unsigned long mismatches = 0;
+	int expected, got;
+	u32 i;
+
+	for (i = 0; i < 65536; i++) {
+		expected = decode_reference(i);
+		got = decode_corsair_float(i);
+		if (got == expected)
+			continue;
+		if (mismatches++ < 10)
+			printf("0x%04x: expected %d, got %d\n", i, expected, got);
+	}
+	printf("%lu of 65536 inputs decode differently\n", mismatches);
+
+	printf("reference: %.2f ns per decode\n", time_decode(decode_reference));
+	printf("driver:    %.2f ns per decode\n", time_decode(decode_corsair_float));
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}